@@ -0,0 +1,415 @@
+/* Benchmark: time the phases of reading and writing disk images
+*	Formats images of the requested sizes, fills them with a mix of files
+*	and times each phase: superblock, FAT and root directory parsing,
+*	filename lookups, disk_get and disk_put. Every measurement is printed
+*	as one JSON object per line so that runs can be diffed between releases
+*/
+
+//////////////////////////////////////////
+// Headers
+// The benchmark is built with the library so that it can time its phases
+#include "disk.c"
+#include <sys/resource.h>
+#include <errno.h>
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Definitions
+#define TINY_FILES			2000		// files of the tiny mix, at most
+#define HUGE_FILE_MAX		(1 << 30)	// largest file of the huge mix
+#define LOOKUP_ROUNDS		100000		// filename lookups per measurement
+
+// File mixes
+enum mix { MIX_TINY, MIX_HUGE, MIX_FRAGMENTED, NUM_MIXES };
+const char* mixNames[NUM_MIXES] = { "tiny", "huge", "fragmented" };
+
+// Counters sampled before and after each phase
+struct sample
+{
+	struct timespec time;
+	uint64_t syscr;				// read syscalls, from /proc/self/io
+	uint64_t syscw;				// write syscalls
+};
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+void takeSample(struct sample*);
+void report(const char*, const char*, uint32_t, uint64_t, struct sample*, uint64_t, uint64_t);
+int makeSource(const char*, uint64_t);
+int fragmentImage(struct disk_image*);
+int benchImage(uint64_t, int);
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Globals
+const char* workdir = "/tmp";	// Directory holding the images and files
+uint32_t block_size = 512;		// Block size of the images
+int iterations = 3;				// Repetitions of the read phases
+uint64_t sampleReads = 0;		// read syscalls made by takeSample itself
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+
+/*
+* Sample the clock and the syscall counters of this process
+*/
+void takeSample(struct sample* s)
+{
+	FILE* io;
+	char line[64];
+	unsigned long long value;
+
+	s->syscr = s->syscw = 0;
+	if((io = fopen("/proc/self/io", "r")) != NULL)
+	{
+		while(fgets(line, sizeof(line), io) != NULL)
+		{
+			if(sscanf(line, "syscr: %llu", &value) == 1)
+				s->syscr = value;
+			else if(sscanf(line, "syscw: %llu", &value) == 1)
+				s->syscw = value;
+		}
+		fclose(io);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &s->time);
+}
+
+/*
+* Print one measurement: the phase took from "start" to now and processed
+*	"ops" operations over "bytes" bytes. The syscalls made by the sampling
+*	itself are not counted
+*/
+void report(const char* phase, const char* mix, uint32_t files, uint64_t image_size,
+	struct sample* start, uint64_t ops, uint64_t bytes)
+{
+	struct sample end;
+	struct rusage usage;
+	double seconds;
+
+	takeSample(&end);
+	getrusage(RUSAGE_SELF, &usage);
+	seconds = (end.time.tv_sec - start->time.tv_sec) + (end.time.tv_nsec - start->time.tv_nsec) / 1e9;
+
+	printf("{\"phase\": \"%s\", \"mix\": \"%s\", \"image_bytes\": %llu, \"block_size\": %u, "
+		"\"files\": %u, \"seconds\": %.6f, \"ops\": %llu, \"ns_per_op\": %.1f, "
+		"\"bytes\": %llu, \"mb_per_s\": %.1f, \"syscr\": %llu, \"syscw\": %llu, "
+		"\"max_rss_kb\": %ld}\n",
+		phase, mix, (unsigned long long)image_size, block_size,
+		files, seconds, (unsigned long long)ops, ops? seconds*1e9/ops : 0.0,
+		(unsigned long long)bytes, seconds > 0? bytes / seconds / (1 << 20) : 0.0,
+		(unsigned long long)(end.syscr - start->syscr - sampleReads),
+		(unsigned long long)(end.syscw - start->syscw),
+		usage.ru_maxrss);
+	fflush(stdout);
+}
+
+/*
+* Write a file of "size" bytes of varied data. Returns 0 on success, -1 on error
+*/
+int makeSource(const char* name, uint64_t size)
+{
+	unsigned char* buffer;
+	size_t length;
+	off_t offset = 0;
+	uint64_t i;
+	int fd;
+
+	if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+		return -1;
+
+	buffer = (unsigned char*)malloc(STAGE_BYTES);
+	for(i=0; i < STAGE_BYTES; i++)
+		buffer[i] = (unsigned char)(i*131 + size);
+
+	while((uint64_t)offset < size)
+	{
+		length = (size - offset < STAGE_BYTES)? size - offset : STAGE_BYTES;
+		if(pwriteFull(NULL, fd, buffer, length, offset) < 0)
+			break;
+		offset += length;
+	}
+
+	free(buffer);
+	close(fd);
+	return ((uint64_t)offset == size)? 0 : -1;
+}
+
+/*
+* Fragment the free space of "img" the way use does: fill it with files of
+*	one block in the directory "fill", then remove every other one so that
+*	the free blocks are single. Returns 0 on success, -1 on error
+*/
+int fragmentImage(struct disk_image* img)
+{
+	uint32_t per_block = block_size / DIR_ENTRY_SIZE;
+	uint32_t fillers;
+	char name[32];
+	int status = -1;
+	uint32_t i;
+	int r;
+
+	// every filler takes a block and an entry of "fill", which grows by a
+	// block at a time
+	read_FAT(img);
+	fillers = (img->FAT->free_blocks > 2)? (uint64_t)(img->FAT->free_blocks - 2) * per_block / (per_block + 1) : 0;
+	if(makeSource("filler", block_size) != 0 || (mkdir("fill", S_IRWXU) != 0 && errno != EEXIST))
+	{
+		printf("error: could not write the filler files in %s\n", workdir);
+		unlink("filler");
+		return -1;
+	}
+
+	// the files are put under their image path, a link of the one source
+	for(i=0; i < fillers; i++)
+	{
+		snprintf(name, sizeof(name), "fill/%u", i);
+		if(link("filler", name) != 0)
+			goto done;
+		r = disk_put(img, name, 0);
+		unlink(name);
+		if(r != 0)
+			goto done;
+	}
+	for(i=0; i < fillers; i += 2)
+	{
+		snprintf(name, sizeof(name), "fill/%u", i);
+		if(disk_remove(img, name) != 0)
+			goto done;
+	}
+	// the metadata of the fillers is not part of the timed puts
+	status = disk_sync(img);
+
+done:
+	rmdir("fill");
+	unlink("filler");
+	return status;
+}
+
+/*
+* Format an image of "image_size" bytes, put the files of mix "mix" into it
+*	and time every phase. Returns 0 on success, -1 on error
+*/
+int benchImage(uint64_t image_size, int mix)
+{
+	struct disk_image* img;
+	struct sample start;
+	uint32_t num_blocks = image_size / block_size;
+	uint32_t data_blocks;
+	uint32_t root_blocks = 8;
+	uint32_t files;
+	uint64_t file_size;
+	uint64_t total_bytes;
+	uint64_t found;
+	char** names;
+	char name[32];
+	int status = -1;
+	uint32_t i;
+	int r;
+
+	// a FAT entry per block plus the root directory must leave half of the
+	// image for the data
+	data_blocks = (num_blocks - 1 - (uint64_t)num_blocks*FAT_ENTRY_SIZE / block_size) / 2;
+
+	// size the mix to the image
+	switch(mix)
+	{
+		case MIX_TINY:
+			files = TINY_FILES;
+			if(files > data_blocks / 2)
+				files = data_blocks / 2;
+			file_size = block_size + block_size / 2;
+			root_blocks = (files + block_size / DIR_ENTRY_SIZE - 1) / (block_size / DIR_ENTRY_SIZE) + 1;
+			break;
+		case MIX_HUGE:
+			file_size = (uint64_t)data_blocks * block_size / 4;
+			if(file_size > HUGE_FILE_MAX)
+				file_size = HUGE_FILE_MAX;
+			files = (uint64_t)data_blocks * block_size / file_size;
+			break;
+		default:
+			// the files take half of the single free blocks left by fragmentImage
+			file_size = (uint64_t)data_blocks * block_size / 2 / 16;
+			if(file_size > HUGE_FILE_MAX)
+				file_size = HUGE_FILE_MAX;
+			files = 16;
+	}
+	if(files == 0 || file_size == 0)
+	{
+		printf("error: a %llu byte image is too small to benchmark\n", (unsigned long long)image_size);
+		return -1;
+	}
+	total_bytes = file_size * files;
+
+	if(disk_format("bench.img", block_size, num_blocks, root_blocks, 0) != 0)
+		return -1;
+
+	// the source files
+	names = (char**)calloc(files, sizeof(char*));
+	for(i=0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "%s%u", mixNames[mix], i);
+		names[i] = strdup(name);
+		if(makeSource(name, file_size) != 0)
+		{
+			printf("error: could not write %s/%s\n", workdir, name);
+			goto done;
+		}
+	}
+
+	if((img = disk_open("bench.img", DISK_WRITE)) == NULL)
+		goto done;
+
+	// fragment the free space so that every file is a chain of single blocks
+	if(mix == MIX_FRAGMENTED && fragmentImage(img) != 0)
+	{
+		disk_close(img);
+		goto done;
+	}
+
+	// disk_put, including the write back of the metadata
+	takeSample(&start);
+	for(i=0; i < files; i++)
+	{
+		if(disk_put(img, names[i], 0) != 0)
+		{
+			disk_close(img);
+			goto done;
+		}
+	}
+	disk_close(img);
+	report("disk_put", mixNames[mix], files, image_size, &start, files, total_bytes);
+
+	for(r=0; r < iterations; r++)
+	{
+		// the steps of disk_open, timed one by one
+		if((img = mapImage("bench.img", 0)) == NULL)
+			goto done;
+
+		takeSample(&start);
+		if(read_superblock(img) < 0)
+		{
+			disk_close(img);
+			goto done;
+		}
+		report("read_superblock", mixNames[mix], files, image_size, &start, 1, SUPERBLOCK_SIZE);
+
+		takeSample(&start);
+		init_FAT(img);
+		read_FAT(img);
+		report("read_FAT", mixNames[mix], files, image_size, &start, img->FAT->num_entries,
+			(uint64_t)img->FAT->num_blocks * block_size);
+
+		takeSample(&start);
+		if(read_FDT(img) < 0)
+		{
+			printf("error: bench.img is not a valid disk image\n");
+			disk_close(img);
+			goto done;
+		}
+		report("read_FDT", mixNames[mix], files, image_size, &start, img->FDT->num_entries,
+			(uint64_t)img->FDT->num_blocks * block_size);
+
+		takeSample(&start);
+		found = 0;
+		for(i=0; i < LOOKUP_ROUNDS; i++)
+			found += (findEntryInFDT(img, names[i % files]) != NULL);
+		report("findEntryInFDT", mixNames[mix], files, image_size, &start, found, 0);
+
+		takeSample(&start);
+		for(i=0; i < files; i++)
+		{
+			if(disk_get(img, names[i], "bench.out") != 0)
+				break;
+		}
+		report("disk_get", mixNames[mix], files, image_size, &start, i, file_size * i);
+		unlink("bench.out");
+
+		disk_close(img);
+	}
+	status = 0;
+
+done:
+	for(i=0; i < files && names[i] != NULL; i++)
+	{
+		unlink(names[i]);
+		free(names[i]);
+	}
+	free(names);
+	unlink("bench.img");
+	return status;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* sizes = "16M,256M,1G";	// Image sizes to benchmark
+	const char* next;
+	struct sample first, second;
+	uint64_t image_size;
+	int failed = 0;
+	int opt;
+	int mix;
+
+	while((opt = getopt(argc, argv, "d:s:b:i:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'd':
+				workdir = optarg;
+				break;
+			case 's':
+				sizes = optarg;
+				break;
+			case 'b':
+				block_size = atoi(optarg);
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			default:
+				iterations = 0;
+		}
+	}
+
+	if(iterations < 1 || optind != argc)
+	{
+		printf("Usage: $./diskbench [-d workdir] [-s size[,size]...] [-b blocksize] [-i iterations]\n"
+			   "  -d  directory for the images and files (default /tmp)\n"
+			   "  -s  image sizes with a K/M/G/T suffix (default 16M,256M,1G)\n"
+			   "  -b  block size of the images (default 512)\n"
+			   "  -i  repetitions of the read phases (default 3)\n");
+		exit(-1);
+	}
+
+	if(chdir(workdir) != 0)
+	{
+		printf("error: could not enter %s\n", workdir);
+		exit(-1);
+	}
+
+	// the read syscalls of sampling the counters are not measured
+	takeSample(&first);
+	takeSample(&second);
+	sampleReads = second.syscr - first.syscr;
+
+	for(next = sizes; next != NULL && *next; next = strchr(next, ','), next = next? next + 1 : NULL)
+	{
+		if((image_size = parse_size(next, ',')) == 0)
+		{
+			printf("error: invalid image size %s\n", next);
+			exit(-1);
+		}
+		for(mix=0; mix < NUM_MIXES; mix++)
+			failed += (benchImage(image_size, mix) != 0);
+	}
+
+	return failed? -1 : 0;
+}
+
+
+//////////////////////////////////////////
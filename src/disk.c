@@ -6,15 +6,20 @@
 ////////////////////////////////////////
 // Headers
 #include "disk.h"
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 ////////////////////////////////////////
 
 ///////////////////////////////////////
 // Definitions
-#define BLOCK_SIZE 				512			// Block size in bytes
+#define SUPERBLOCK_SIZE 		512			// Bytes read from block 0 for the superblock
+#define MIN_BLOCK_SIZE 			512			// Block sizes are powers of 2 in this range
+#define MAX_BLOCK_SIZE 			32768
 
 // FAT entry values
 #define FAT_ENTRY_SIZE 			4 			// FAT entry size in bytes 
-#define FAT_ENTRIES_PER_BLOCK 	128			// BLOCK_SIZE/FAT_ENTRY_SIZE
 // Status values for FAT entries
 #define BLOCK_AVAILABLE 		0x00000000	// 0
 #define BLOCK_RESERVED 			0x00000001	// 1
@@ -32,50 +37,252 @@
 #define DIR_ENTRY_MODIFY_TIME_SIZE   7
 #define DIR_ENTRY_FILE_NAME_SIZE    31 
 #define DIR_ENTRY_UNUSED_SIZE        6
-// Offsets for directory entry time values
-#define TIME_YEAR_SIZE 		2
-#define TIME_MONTH_SIZE		1
-#define TIME_DAY_SIZE 		1
-#define TIME_HOUR_SIZE 		1
-#define TIME_MINUTE_SIZE 	1
-#define TIME_SECOND_SIZE 	1
-
-struct Time
-{
-	unsigned char seconds;
-	unsigned char minutes;
-	unsigned char hour;
-	unsigned char day;
-	unsigned char month;
-	short year;
+
+// Status bits of a directory entry
+#define DIR_ENTRY_USED				0x01
+#define DIR_ENTRY_FILE				0x02
+#define DIR_ENTRY_DIRECTORY			0x04
+
+// Problems of a file found by disk_check
+#define CHECK_BAD_START			0x01	// the first block is outside the FAT
+#define CHECK_BROKEN			0x02	// the chain reaches a free, reserved or invalid entry
+#define CHECK_SHORT				0x04	// the chain ends before the file does
+#define CHECK_LONG				0x08	// the chain goes on after the file ends
+#define CHECK_CYCLE				0x10	// the chain loops back on itself
+#define CHECK_CROSSLINK			0x20	// a block is also used by another file or the metadata
+#define CHECK_NUM_BLOCKS		0x40	// the block count does not match the size
+#define NUM_CHECK_PROBLEMS		7
+// Problems that a repair fixes by removing the file
+#define CHECK_UNREADABLE		(CHECK_BAD_START | CHECK_BROKEN | CHECK_SHORT | CHECK_CYCLE | CHECK_CROSSLINK)
+// Owner of the superblock, FAT and root directory blocks in the reference array
+#define OWNER_METADATA			UINT32_MAX
+// Problems of each kind reported one by one, the rest are only counted
+#define CHECK_REPORT_LIMIT		20
+
+// Identifies a committed journal, see struct journalHeader
+#define JOURNAL_MAGIC			"CSCJRNL1"
+#define JOURNAL_SUFFIX			".journal"
+
+// Number of bytes staged in memory per data or metadata write
+#define STAGE_BYTES 			(4 << 20)
+// Data moved by disk_defrag between two commits of the metadata
+#define DEFRAG_BATCH_BYTES		(64 << 20)
+#define DEFRAG_BATCH_FILES		256
+
+// Instrumentation, collected only when the image is opened with DISK_STATS.
+// When it is not, each probe costs one test of a NULL pointer
+#define STAT_ADD(stats, counter, n) \
+	do { if(__builtin_expect((stats) != NULL, 0)) \
+		__atomic_fetch_add(&(stats)->counters[counter], (uint64_t)(n), __ATOMIC_RELAXED); } while(0)
+#define PHASE_START(stats) \
+	(__builtin_expect((stats) != NULL, 0)? statClock() : 0)
+#define PHASE_STOP(stats, phase, start) \
+	do { if(__builtin_expect((stats) != NULL, 0)) statPhaseDone(stats, phase, start); } while(0)
+
+// Timed phases. They may nest: FAT blocks are decoded on demand by
+// the allocation and the chain walks
+enum statPhase
+{
+	PHASE_OPEN,				// disk_open, up to the parsed root directory
+	PHASE_FAT_DECODE,		// decoding FAT blocks
+	PHASE_FDT_READ,			// parsing the root directory
+	PHASE_LOOKUP,			// filename lookups
+	PHASE_ALLOC,			// searching and reserving free blocks
+	PHASE_CHAIN_WALK,		// resolving FAT chains into extents
+	PHASE_READ_INPUT,		// disk_put reading the input file
+	PHASE_WRITE_DATA,		// disk_put writing data blocks
+	PHASE_COPY_OUT,			// disk_get writing the output file
+	PHASE_DIR_UPDATE,		// disk_put linking the chain and filling the entry
+	PHASE_FAT_FLUSH,		// writing back the FAT
+	PHASE_FDT_FLUSH,		// writing back the root directory
+	PHASE_JOURNAL,			// committing and replaying the metadata journal
+	NUM_PHASES
+};
+
+// Counters
+enum statCounter
+{
+	COUNT_SYSCALLS,			// system calls on files
+	COUNT_BYTES_READ,		// bytes read from input files
+	COUNT_BYTES_WRITTEN,	// bytes written to the image
+	COUNT_BYTES_COPIED,		// bytes copied out of the image
+	COUNT_FAT_DECODED,		// FAT entries decoded
+	COUNT_FAT_SCANNED,		// FAT entries examined searching for free blocks
+	COUNT_BLOCKS_ALLOCATED,	// blocks allocated
+	COUNT_CHAIN_HOPS,		// FAT entries followed along chains
+	COUNT_LOOKUPS,			// filename lookups
+	NUM_COUNTERS
+};
+
+// When the stores of a DISK_MMAP image are synced to the disk image
+enum msyncMode { MSYNC_NONE, MSYNC_END, MSYNC_FILE };
+
+// On-disk layouts, used in place in the map: their multi byte fields are
+// big endian and are read and written with be16toh/be32toh and htobe16/htobe32
+struct __attribute__((packed)) diskSuperblock
+{
+	char id[8];
+	uint16_t block_size;
+	uint32_t num_blocks;
+	uint32_t fat_start;
+	uint32_t fat_blocks;
+	uint32_t root_start;
+	uint32_t root_blocks;
+};
+
+struct __attribute__((packed)) diskTime
+{
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hour;
+	uint8_t minutes;
+	uint8_t seconds;
 };
 
-struct dirEntry
+struct __attribute__((packed)) dirEntry
 {
-	unsigned char status;
+	uint8_t status;
 	uint32_t start_block;
 	uint32_t num_blocks;
 	uint32_t file_size;
-	struct Time create_time;
-	struct Time modify_time;
+	struct diskTime create_time;
+	struct diskTime modify_time;
 	char filename[DIR_ENTRY_FILE_NAME_SIZE];
+	uint8_t unused[DIR_ENTRY_UNUSED_SIZE];
+};
+_Static_assert(sizeof(struct dirEntry) == DIR_ENTRY_SIZE, "a directory entry is 64 bytes on disk");
+
+// The metadata journal, "<image>.journal": a header, the records and the
+// checksum of both. Each record is the new content of a range of metadata
+// blocks. The fields are big endian
+struct __attribute__((packed)) journalHeader
+{
+	char magic[8];				// JOURNAL_MAGIC
+	uint32_t records;
+	uint64_t length;			// bytes of the records
+};
+
+struct __attribute__((packed)) journalRecord
+{
+	uint64_t offset;			// offset of the range in the image
+	uint32_t length;			// bytes of the range, that follow the record
 };
 
 struct FAT
 {
 	uint32_t start_block;
 	uint32_t num_blocks;
+	uint32_t entries_per_block;	// block_size / FAT_ENTRY_SIZE
+	int entries_shift;			// log2 of entries_per_block
 	int free_blocks;
 	int reserved_blocks;
 	int allocated_blocks;
-	int* entries;
+	uint32_t num_entries;		// number of usable entries (blocks) in the FAT
+	// The entries are kept as bitmaps: an entry pointing to the block after
+	// its own has its bit set in chain_map, and the few others that are not
+	// free (reserved, chain ends and jumps) are held in the jump table
+	uint64_t* chain_map;		// one bit per block, set when its entry is the next block
+	uint64_t* jump_map;			// one bit per block, set when its entry is in the jump table
+	struct fatJump* jumps;		// open addressing table of the other entries in use
+	int jumps_bits;				// log2 of the number of slots of the jump table
+	uint32_t num_jumps;
+	pthread_rwlock_t jumps_lock;	// chain walks read the table while it grows
+	uint64_t* free_map;			// one bit per block, set when the block is free
+	uint32_t next_free;			// allocation cursor: search for free blocks from here
+	uint32_t no_run_from;		// no free run of this many blocks exists
+	uint64_t* dirty_map;		// one bit per FAT block, set when it must be written back
+	uint64_t* valid_map;		// one bit per FAT block, set once it is decoded
+	uint32_t decoded_blocks;	// number of FAT blocks decoded so far
+	pthread_mutex_t lock;		// serializes decoding between threads
+};
+
+// FAT entry held in the jump table, an entry of value 0 is an empty slot
+struct fatJump
+{
+	uint32_t block;
+	uint32_t value;
+};
+
+struct extent
+{
+	uint32_t start_block;
+	uint32_t num_blocks;
+};
+
+// The extents of a file and the byte offset in the file where each one
+// starts, so that any offset is found by a binary search, see disk_pread
+struct extentIndex
+{
+	int count;
+	struct extent* extents;
+	uint64_t* offsets;
+};
+
+// A file or directory checked by disk_check: entry "entry" of "dir"
+struct checkItem
+{
+	struct FDT* dir;
+	int entry;
+};
+
+// Shared by the threads of disk_check
+struct checkState
+{
+	struct disk_image* img;
+	struct checkItem* items;	// the entries of the directories reached so far
+	int num_items;				// the items are checked one tree level at a time,
+	int level_end;				// up to this one
+	uint32_t* owner;			// per block, the item + 1 using it, 0 if none
+	uint8_t* problems;			// per item, CHECK_* flags
+	uint32_t* last_block;		// per item, the block where the file ends
+	int next_entry;				// next item to be checked
+};
+
+// Fragmentation of the files and of the free space, see scanFATRuns
+struct fragReport
+{
+	uint32_t files;					// files in the root directory
+	uint32_t fragmented_files;		// files of more than one extent
+	uint64_t file_extents;			// extents of all the files
+	uint64_t file_blocks;			// blocks of all the files
+	uint32_t free_runs;				// runs of consecutive free blocks
+	uint32_t largest_free_run;
+	uint32_t largest_free_start;	// first block of the largest free run
+	uint32_t histogram_runs[33];	// free runs by bit length of their length
+	uint64_t histogram_blocks[33];	// and the blocks in them
 };
 
+// A directory: the root directory or a subdirectory, stored as a FAT chain
+// of blocks of directory entries
 struct FDT
 {
 	uint32_t start_block;
 	uint32_t num_blocks;
-	struct dirEntry* root;
+	uint32_t entries_per_block;	// block_size / DIR_ENTRY_SIZE
+	uint32_t* blocks;			// the blocks of the directory, in order
+	unsigned char** shadow;		// per block, the copy being modified, NULL while the map is current
+	int* index;					// filename hash table of entry positions + 1, 0 is empty
+	uint32_t index_size;		// number of slots in the hash table, a power of 2
+	int indexed;				// the index is built on the first lookup
+	pthread_mutex_t index_lock;
+	uint64_t* dirty_map;		// one bit per block, set when it must be written back
+	int num_entries;			// entries_per_block * num_blocks
+	int* free_slots;			// stack of the unused entries, the lowest on top, known once indexed
+	int num_free;
+	int free_capacity;
+	char* path;					// path from the root, "" for the root
+	struct extentIndex** extent_cache;	// per entry, the extents of its file once disk_pread needs them
+	struct FDT* parent;			// NULL for the root
+	int parent_entry;			// position of the directory's entry in its parent
+	int unchained;				// the root, read as contiguous blocks for its broken chain; it may not grow
+};
+
+struct diskStats
+{
+	uint64_t phase_ns[NUM_PHASES];		// time spent in each phase
+	uint64_t phase_calls[NUM_PHASES];	// times each phase ran
+	uint64_t counters[NUM_COUNTERS];
 };
 
 struct fileSystem
@@ -83,865 +290,4217 @@ struct fileSystem
 	uint64_t id;
 	uint16_t block_size;
 	int num_blocks;
+	int block_shift;			// log2 of block_size
+};
+
+// Transaction of the metadata written by one disk_sync, see commitJournal
+struct journal
+{
+	char* path;					// path of the journal file
+	int fd;						// -1 until the first commit
+	int collecting;				// set while disk_sync gathers the records
+	int pending;				// the journal file holds a transaction not applied yet
+	unsigned char* buffer;		// header, records and room for the checksum
+	size_t size;
+	size_t capacity;
+	uint32_t records;
+};
+
+struct disk_image
+{
+	char* path;					// filename of the disk image
+	int fd;						// file descriptor of the disk image
+	int writable;				// opened with DISK_WRITE
+	int mapped_writes;			// opened with DISK_MMAP, changes are stored into the map
+	int msync_mode;				// with DISK_MMAP, when the stores are synced, see enum msyncMode
+	off_t dirty_start;			// with DISK_MMAP, range of the map holding file data not synced yet
+	off_t dirty_end;
+	unsigned char* map;			// map of the disk image as array of bytes
+	size_t map_size;
+	struct fileSystem* fileSystem;
+	struct FAT* FAT;
+	struct FDT* FDT;
+	struct FDT** dirs;			// the directories opened so far, the root first
+	int num_dirs;
+	int dirs_capacity;
+	int* dir_slots;				// path hash table of positions in dirs + 1, 0 is empty
+	uint32_t dir_slots_size;	// a power of 2
+	pthread_mutex_t dirs_lock;	// path resolution may open directories from many threads
+	struct diskStats* stats;	// instrumentation, NULL unless DISK_STATS
+	struct journal* journal;	// metadata journal, NULL unless DISK_JOURNAL
 };
 ///////////////////////////////////////
 
 ////////////////////////////////////////
 // Globals
-struct FAT* FAT;
-struct FDT* FDT;
-int dir_entries = 0;
-int  firstRootEntryFree = -1;
-int  firstRootEntryFreeBlock = -1;
-struct fileSystem* fileSystem;
+// FAT decoding kernel picked for this CPU, see decodeFATEntries
+void (*decodeFAT)(const unsigned char*, uint32_t, uint32_t, uint64_t*, uint64_t*, uint32_t*) = NULL;
+// Descriptions of the CHECK_* problems, by bit
+const char* checkProblemNames[NUM_CHECK_PROBLEMS] = { "start block outside the file system",
+	"chain broken", "chain shorter than the file", "chain longer than the file", "chain loops",
+	"blocks shared with another file or the metadata", "wrong block count" };
+// Names of the phases and counters in the statistics
+const char* phaseNames[NUM_PHASES] = { "open", "fat_decode", "fdt_read", "lookup", "alloc",
+	"chain_walk", "read_input", "write_data", "copy_out", "dir_update", "fat_flush", "fdt_flush", "journal" };
+const char* counterNames[NUM_COUNTERS] = { "syscalls", "bytes_read", "bytes_written",
+	"bytes_copied", "fat_entries_decoded", "fat_entries_scanned", "blocks_allocated",
+	"chain_hops", "lookups" };
+////////////////////////////////////////
+
+////////////////////////////////////////
+// Prototypes
+void loadFATBlock(struct disk_image*, uint32_t);
+uint64_t statClock(void);
+void statPhaseDone(struct diskStats*, int, uint64_t);
+int pwritevFull(struct diskStats*, int, struct iovec*, int, off_t);
+int resolveExtents(struct disk_image*, uint32_t, uint32_t, struct extent**);
+int allocFATRun(struct disk_image*, uint32_t, uint32_t*);
+void setFATEntry(struct disk_image*, uint32_t, uint32_t);
+void freeExtentIndex(struct extentIndex*);
 ////////////////////////////////////////
 
 ////////////////////////////////////////
 // Functions
 
 /*
-*	Determine if given status value means directory entry is in use
+*	Return a monotonic time in nanoseconds for the phase timers
 */
-bool dirEntryIsUsed(unsigned char status)
+uint64_t statClock(void)
 {
-	// bit mask
-	int used_mask = 0x01;
-	return (status & used_mask)? true : false;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
 }
 
 /*
-*	Determine if given status value means directory entry is a file
+*	Account the time since "start" to "phase"
 */
-bool dirEntryIsFile(unsigned char status)
+void statPhaseDone(struct diskStats* stats, int phase, uint64_t start)
 {
-	// bit mask
-	int file_mask = 0x02;
-	return (status & file_mask)? true : false;
+	__atomic_fetch_add(&stats->phase_ns[phase], statClock() - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->phase_calls[phase], 1, __ATOMIC_RELAXED);
 }
 
 /*
-* Returns the directory entry in the FDT that has the filename
+*	Read until "len" bytes are read or the end of the file is reached.
+*	Returns the number of bytes read, -1 on error
 */
-struct dirEntry* findEntryInFDT(char* filename)
+ssize_t readFull(struct diskStats* stats, int fd, void* buffer, size_t len)
 {
-	struct dirEntry* entry = NULL;
-	struct dirEntry cur_entry;
+	size_t total = 0;
+	ssize_t n;
 
-	int i;
-	for(i=0; i<dir_entries; i++)
+	while(total < len)
 	{
-		cur_entry = FDT->root[i];
-		if((!strcmp(filename, cur_entry.filename)) &&
-			dirEntryIsFile(cur_entry.status))
-		{
-			entry = &cur_entry;
+		STAT_ADD(stats, COUNT_SYSCALLS, 1);
+		n = read(fd, (unsigned char*)buffer + total, len - total);
+		if(n == 0)
 			break;
-		}
+		if(n < 0)
+			return -1;
+		total += n;
 	}
-	return entry;
+	return total;
 }
+
 /*
-*	Return the id of the next FAT block. -1 On end of FAT
+*	Return the byte offset of "block" in the disk image
 */
-int getNextFatBlock(int current_block)
+off_t blockOffset(struct disk_image* img, uint64_t block)
 {
-	// for each FAT entry
-	int i = 0;
-	while(FAT->entries[i] != NULL)
-	{
-		// if it is reserved, return the entry id
-		if(FAT->entries[i] == BLOCK_RESERVED) return i;
-	}
-
-    return -1;
+	return (off_t)(block << img->fileSystem->block_shift);
 }
+
 /*
-*	Searches the FAT for the next avaiable entry. 
-*	Stores the entry offset in "position"
+*	Return the number of blocks needed to hold "bytes" bytes
 */
-int getNextFATEntry(int fp, int* position)
+uint32_t blocksForBytes(struct disk_image* img, uint64_t bytes)
 {
-	unsigned char fat_entry[FAT_ENTRY_SIZE];
-    int current_block = FAT->start_block;
-    int entryId = 0;
-    int status, auxInt;
-    int i, j;
+	return (uint32_t)((bytes + img->fileSystem->block_size - 1) >> img->fileSystem->block_shift);
+}
 
-    if (position == NULL)
-    {
-        return -1;
-    }
+/*
+*	Write the pages of the map holding "len" bytes at "offset" back to the
+*	disk image and wait for them. Returns 0 on success, -1 on error
+*/
+int syncMapRange(struct disk_image* img, off_t offset, size_t len)
+{
+	off_t first = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
 
-    // for each FAT block
-    for (i=0; i < FAT->num_blocks; i++)
-    {
-    	// go to next block
-    	//current_index = current_block*BLOCK_SIZE;
-    	lseek(fp, current_block*BLOCK_SIZE, SEEK_SET);
+	if(len == 0)
+		return 0;
+	STAT_ADD(img->stats, COUNT_SYSCALLS, 1);
+	return msync(&img->map[first], len + (offset - first), MS_SYNC);
+}
 
-        // if no more blocks
-        if(current_block < 0)  
-        {
-            break;
-        }
+/*
+*	Write all "len" bytes at "offset", retrying short writes. -1 on error
+*/
+int pwriteFull(struct diskStats* stats, int fd, const void* buffer, size_t len, off_t offset)
+{
+	ssize_t n;
 
-        // for each FAT entry
-        for (j=0; j < FAT_ENTRIES_PER_BLOCK; j++)
-        {
-        	// read the entry
-            read(fp, fat_entry, FAT_ENTRY_SIZE);
-            memcpy(&auxInt, &fat_entry, FAT_ENTRY_SIZE);
-            status = htonl(auxInt);
+	while(len > 0)
+	{
+		STAT_ADD(stats, COUNT_SYSCALLS, 1);
+		n = pwrite(fd, buffer, len, offset);
+		if(n <= 0)
+			return -1;
+		buffer = (const unsigned char*)buffer + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
 
-            if(status == BLOCK_AVAILABLE)
-            {
-            	// update the position
-                int fpPosition = (intmax_t)lseek(fp, 0, SEEK_CUR);
-            	*position = (fpPosition - FAT_ENTRY_SIZE);
-            	//printf("getting next FAT entry... block available, current position: %d new position: %d\n", fpPosition,*position);
-                return entryId;
-            }
+/*
+*	Determine if given status value means directory entry is in use
+*/
+bool dirEntryIsUsed(unsigned char status)
+{
+	// bit mask
+	int used_mask = 0x01;
+	return (status & used_mask)? true : false;
+}
 
-            entryId++;
+/*
+*	Determine if given status value means directory entry is a file
+*/
+bool dirEntryIsFile(unsigned char status)
+{
+	// bit mask
+	int file_mask = 0x02;
+	return (status & file_mask)? true : false;
+}
 
-        }
+/*
+*	Determine if given status value means directory entry is a directory
+*/
+bool dirEntryIsDirectory(unsigned char status)
+{
+	return (status & DIR_ENTRY_DIRECTORY)? true : false;
+}
 
-        // go to next FAT block
-        current_block = getNextFatBlock(current_block);
-    }
+/*
+* Returns entry "entry" of directory "dir" as it currently is: in its
+*	block's copy when the block is being modified, otherwise in the map
+*/
+struct dirEntry* dirEntryAt(struct disk_image* img, struct FDT* dir, int entry)
+{
+	uint32_t dir_block = entry / dir->entries_per_block;
+	unsigned char* block = dir->shadow[dir_block];
 
-    // no FAT entry available
-    return -1;
+	if(block == NULL)
+		block = &img->map[blockOffset(img, dir->blocks[dir_block])];
+	return &((struct dirEntry*)block)[entry % dir->entries_per_block];
 }
+
 /*
-* Initialize a Time struct with the bytes in buffer
+* Free an extent index, if any
 */
-void init_timeStruct(struct Time* timeP, unsigned char* buffer, int bufsize)
+void freeExtentIndex(struct extentIndex* index)
 {
-	int offset = 0;
+	if(index == NULL)
+		return;
+	free(index->extents);
+	free(index->offsets);
+	free(index);
+}
 
+/*
+* Returns entry "entry" of directory "dir" for modification. Its block is
+*	copied out of the map and marked for write back by flush_FDT
+*/
+struct dirEntry* writableDirEntry(struct disk_image* img, struct FDT* dir, int entry)
+{
+	uint32_t dir_block = entry / dir->entries_per_block;
 
-	struct Time timeStruct = *timeP;
+	// the file may change, its extents are resolved again when needed
+	freeExtentIndex(dir->extent_cache[entry]);
+	dir->extent_cache[entry] = NULL;
 
-	// Ensure that buffer is big enough to qualify as a directory entry
-    if ( (buffer != NULL) && (bufsize >= DIR_ENTRY_MODIFY_TIME_SIZE))
-    {
-        // Read Time struct fields 
-        // year
-        memcpy(&timeStruct.year, &buffer[offset], TIME_YEAR_SIZE);
-        timeStruct.year = htons(timeStruct.year);
-        offset += TIME_YEAR_SIZE;
-        //printf("\nyear = %d\n", timeStruct.year);
-        
-        // month
-        timeStruct.month = buffer[offset];
-        offset += TIME_MONTH_SIZE;
-        //printf("month = %d\n", timeStruct.month);
-
-        // day
-        timeStruct.day = buffer[offset];
-        offset += TIME_DAY_SIZE;
-        //printf("day = %d\n", timeStruct.day);
-
-        // hour
-        timeStruct.hour = buffer[offset];
-        offset += TIME_HOUR_SIZE;  
-       //printf("hour = %d\n", timeStruct.hour);
-
-        // minute
-        timeStruct.minutes = buffer[offset];
-        offset += TIME_MINUTE_SIZE;
-        //printf("minutes = %d\n", timeStruct.minutes);
-
-        // second
-        timeStruct.seconds = buffer[offset];
-        offset += TIME_SECOND_SIZE;
-        //printf("seconds = %d\n", timeStruct.seconds);
-    }
-    else
-    {
-        printf("ERROR: Invalid time buffer info\n");
-        exit(-1);
-    }
+	if(dir->shadow[dir_block] == NULL)
+	{
+		dir->shadow[dir_block] = (unsigned char*)malloc(img->fileSystem->block_size);
+		memcpy(dir->shadow[dir_block], &img->map[blockOffset(img, dir->blocks[dir_block])],
+			img->fileSystem->block_size);
+		dir->dirty_map[dir_block / 64] |= (uint64_t)1 << (dir_block % 64);
+	}
+	return dirEntryAt(img, dir, entry);
+}
 
-    *timeP = timeStruct;
+/*
+* Returns root entry "entry" as it currently is
+*/
+struct dirEntry* rootEntry(struct disk_image* img, int entry)
+{
+	return dirEntryAt(img, img->FDT, entry);
 }
 
 /*
-* Free allocated memory
+* Returns root entry "entry" for modification
 */
-void free_fileSystem()
+struct dirEntry* writableRootEntry(struct disk_image* img, int entry)
 {
-	free(fileSystem);
+	return writableDirEntry(img, img->FDT, entry);
 }
-void free_FAT()
+
+/*
+* Record that entry "entry" of "dir" is unused; it is the next one taken
+*/
+void pushFreeDirEntry(struct FDT* dir, int entry)
 {
-	free(FAT);
+	if(dir->num_free == dir->free_capacity)
+	{
+		dir->free_capacity = dir->free_capacity? dir->free_capacity * 2 : 64;
+		dir->free_slots = (int*)realloc(dir->free_slots, sizeof(int) * dir->free_capacity);
+	}
+	dir->free_slots[dir->num_free++] = entry;
 }
-void free_FDT()
+
+/*
+* Take an unused entry of "dir", which must be indexed. Returns its
+*	position, -1 if the directory is full
+*/
+int popFreeDirEntry(struct FDT* dir)
 {
-	free(FDT);
+	return (dir->num_free > 0)? dir->free_slots[--dir->num_free] : -1;
 }
 
-/* Store the superblock's fields into the correct struct, 
-* then print the values if flagged to do so
+/*
+* Hash a filename of at most DIR_ENTRY_FILE_NAME_SIZE characters (FNV-1a)
 */
-int read_superblock(unsigned char* map, int print)
+uint32_t hashFilename(const char* filename)
 {
+	uint32_t hash = 2166136261u;
+	int i;
 
-	unsigned char* superblock;
-	int offset = 8;
+	for(i=0; i < DIR_ENTRY_FILE_NAME_SIZE && filename[i] != '\0'; i++)
+	{
+		hash ^= (unsigned char)filename[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-	// Allocate memory for the file system structs
-	FAT = (struct FAT*)malloc(sizeof(FAT));
-	FDT = (struct FDT*)malloc(sizeof(FDT));
-	fileSystem = (struct fileSystem*)malloc(sizeof(fileSystem));
-
-	// Allocate 512 bytes to superblock
-	superblock = (unsigned char*)calloc(BLOCK_SIZE, 1);
-	// Read 512 bytes into the superblock
-	memcpy(superblock, map, BLOCK_SIZE);
-
-	// Copy bytes 8 & 9 as the block size field
-	memcpy(&fileSystem->block_size, &superblock[offset], 2);
-	fileSystem->block_size = htons(fileSystem->block_size);
-	offset += 2;
+/*
+* Allocate an empty filename index with room for "num_entries" entries
+*/
+void init_FDTIndex(struct FDT* dir, int num_entries)
+{
+	dir->index_size = 1;
+	// keep the table at most half full
+	while(dir->index_size < (uint32_t)num_entries * 2)
+		dir->index_size <<= 1;
 
-	// Copy bytes 10-13 as number of blocks in file system
-	memcpy(&fileSystem->num_blocks, &superblock[offset], 4);
-	fileSystem->num_blocks = htonl(fileSystem->num_blocks);
-	offset += 4;
+	dir->index = (int*)calloc(dir->index_size, sizeof(int));
+}
 
-	// Copy bytes 14-17 as FAT start block
-	memcpy(&FAT->start_block, &superblock[offset], 4);
-	FAT->start_block = htonl(FAT->start_block);
-	offset += 4;
+/*
+* Add the entry at position "entry" of "dir" to its filename index.
+*	If the name is already indexed the first entry keeps it
+*/
+void indexDirEntry(struct disk_image* img, struct FDT* dir, int entry)
+{
+	uint32_t mask = dir->index_size - 1;
+	uint32_t slot = hashFilename(dirEntryAt(img, dir, entry)->filename) & mask;
 
-	// Copy bytes 18-21 as number of blocks in FAT
-	memcpy(&FAT->num_blocks, &superblock[offset], 4);
-	FAT->num_blocks = htonl(FAT->num_blocks);
-	offset += 4;
+	while(dir->index[slot] != 0)
+	{
+		if(!strncmp(dirEntryAt(img, dir, dir->index[slot] - 1)->filename,
+			dirEntryAt(img, dir, entry)->filename, DIR_ENTRY_FILE_NAME_SIZE))
+		{
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+	dir->index[slot] = entry + 1;
+}
 
-	// Copy bytes 22-25 as FDT start block
-	memcpy(&FDT->start_block, &superblock[offset], 4);
-	FDT->start_block = htonl(FDT->start_block);
-	offset += 4;
+/*
+* Remove the entry at position "entry" of "dir" from its filename index,
+*	while it still holds its name. The entries probed past it are shifted
+*	back so that every lookup still finds them
+*/
+void unindexDirEntry(struct disk_image* img, struct FDT* dir, int entry)
+{
+	uint32_t mask = dir->index_size - 1;
+	uint32_t slot = hashFilename(dirEntryAt(img, dir, entry)->filename) & mask;
+	uint32_t next;
+	uint32_t home;
+
+	while(dir->index[slot] != 0 && dir->index[slot] != entry + 1)
+		slot = (slot + 1) & mask;
+	// a second entry of an indexed name is not in the index
+	if(dir->index[slot] == 0)
+		return;
+
+	next = slot;
+	while(dir->index[next = (next + 1) & mask] != 0)
+	{
+		// an entry may fill the hole if it hashes at or before it
+		home = hashFilename(dirEntryAt(img, dir, dir->index[next] - 1)->filename) & mask;
+		if(((next - home) & mask) >= ((next - slot) & mask))
+		{
+			dir->index[slot] = dir->index[next];
+			slot = next;
+		}
+	}
+	dir->index[slot] = 0;
+}
 
-	// Copy bytes 26-29 as number of blocks in FDT
-	memcpy(&FDT->num_blocks, &superblock[offset], 4);
-	FDT->num_blocks = htonl(FDT->num_blocks);
-	offset += 4;
+/*
+* Double the filename index of "dir" when the directory has grown past
+*	half of it
+*/
+void growFDTIndex(struct disk_image* img, struct FDT* dir)
+{
+	int* old_index = dir->index;
+	uint32_t old_size = dir->index_size;
+	uint32_t i;
 
+	if((uint32_t)dir->num_entries * 2 <= dir->index_size)
+		return;
 
-	if(print)
+	init_FDTIndex(dir, dir->num_entries);
+	for(i=0; i < old_size; i++)
 	{
-		printf("\nSuper block information:\n");
-		printf("Block size: %d\n", fileSystem->block_size);
-		printf("Block count: %d\n", fileSystem->num_blocks);
-		printf("FAT starts: %d\n", FAT->start_block);
-		printf("FAT blocks: %d\n",FAT->num_blocks);
-		printf("Root directory start: %d\n", FDT->start_block);	
-		printf("Root directory blocks: %d\n", FDT->num_blocks);
+		if(old_index[i] != 0)
+			indexDirEntry(img, dir, old_index[i] - 1);
 	}
-
-	// return the current index as a result of reading the map
-	return offset;
-
+	free(old_index);
 }
 
 /*
-* Traverse the FAT and record entry statistics if flagged to do so
+* Index the entries of "dir" by name and list its unused entries, once.
+*	Opening a directory does not read it, the first lookup or disk_put does
 */
-int read_FAT(unsigned char* map, int print)
+void buildFDTIndex(struct disk_image* img, struct FDT* dir)
 {
-	int current_block;
-	int current_index;
-	int end_index;
-	int status;
-	int i,j;
-
-	// Initialize the pointer for the FAT's list of entries
-	FAT->entries = (int*)malloc(sizeof(FAT->entries)*FAT->num_blocks*FAT_ENTRIES_PER_BLOCK);
+	int i;
 
-	current_block = FAT->start_block;
-	end_index = (FAT->start_block + FAT->num_blocks)*BLOCK_SIZE;
+	if(__atomic_load_n(&dir->indexed, __ATOMIC_ACQUIRE))
+		return;
 
-	// for every FAT block
-	for(i=0; i < FAT->num_blocks; i++)
+	pthread_mutex_lock(&dir->index_lock);
+	if(!dir->indexed)
 	{
-		current_index = current_block*BLOCK_SIZE;
-		//printf("Block %d\n", current_block);
-		// Double check to make sure we're still indexing the FAT table
-		if(current_index == end_index)
-			break;
-		// for every entry in the FAT block
-		for(j=0; j< FAT_ENTRIES_PER_BLOCK; j++)
+		init_FDTIndex(dir, dir->num_entries);
+		dir->num_free = 0;
+		for(i=0; i < dir->num_entries; i++)
+		{
+			if(dirEntryIsUsed(dirEntryAt(img, dir, i)->status))
+				indexDirEntry(img, dir, i);
+		}
+		// new files take the first entries available
+		for(i=dir->num_entries - 1; i >= 0; i--)
 		{
-			// read the entry's first 4 bytes as status value
-			memcpy(&status, &map[current_index], FAT_ENTRY_SIZE);
-			status = htonl(status);
-			//printf("\tIndex: %d Status: %.4x\n",current_index,status);
+			if(!dirEntryIsUsed(dirEntryAt(img, dir, i)->status))
+				pushFreeDirEntry(dir, i);
+		}
+		__atomic_store_n(&dir->indexed, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dir->index_lock);
+}
 
-			// increment FAT statistics based on status found
-			if(status == BLOCK_AVAILABLE)
-			{
-				//printf("index %d is free\n",current_index);
-				FAT->free_blocks++;
-			}
-			else if(status == BLOCK_RESERVED)
-			{
-				//printf("index %d is reserved\n",current_index);
-				FAT->reserved_blocks++;
-			}
-			else
-			{
-				//printf("index %d is allocated\n",current_index);
-				FAT->allocated_blocks++;
-			}
+/*
+* Returns the entry of "dir" named by the "length" characters of "name",
+*	NULL if there is none. Its position is stored in "position"
+*/
+struct dirEntry* findEntryInDir(struct disk_image* img, struct FDT* dir, const char* name, int length, int* position)
+{
+	char key[DIR_ENTRY_FILE_NAME_SIZE + 1];
+	struct dirEntry* cur_entry;
+	uint32_t mask;
+	uint32_t slot;
 
-			// Store the entry for later use
-			FAT->entries[i*FAT_ENTRIES_PER_BLOCK+j] = status;
+	if(length > DIR_ENTRY_FILE_NAME_SIZE)
+		return NULL;
+	memcpy(key, name, length);
+	key[length] = '\0';
 
-			// Go to next entry
-			current_index += FAT_ENTRY_SIZE;
-		}
+	buildFDTIndex(img, dir);
+	mask = dir->index_size - 1;
+	slot = hashFilename(key) & mask;
 
-		current_block++;
+	while(dir->index[slot] != 0)
+	{
+		cur_entry = dirEntryAt(img, dir, dir->index[slot] - 1);
+		if(!strncmp(key, cur_entry->filename, DIR_ENTRY_FILE_NAME_SIZE))
+		{
+			if(position != NULL)
+				*position = dir->index[slot] - 1;
+			return cur_entry;
+		}
+		slot = (slot + 1) & mask;
 	}
+	return NULL;
+}
+
+/*
+* Copy "path" into "normal" as its components separated by single '/',
+*	without the leading, trailing, empty and "." components. Returns the
+*	length of "normal", -1 if a component is ".." or too long to be
+*	the name of an entry
+*/
+int normalizePath(const char* path, char* normal)
+{
+	int length = 0;
+	int start;
 
-	// Print FAT statistics if flagged to do so
-	if(print)
+	while(*path != '\0')
 	{
-		printf("\nFAT information:\n");
-	    printf("Free Blocks: %d\n", FAT->free_blocks);
-	    printf("Reserved Blocks: %d\n", FAT->reserved_blocks);
-	    printf("Allocated Blocks: %d\n", FAT->allocated_blocks);
+		while(*path == '/')
+			path++;
+		for(start = 0; path[start] != '\0' && path[start] != '/'; start++)
+			;
+		if((start == 1 && path[0] == '.') || start == 0)
+		{
+			path += start;
+			continue;
+		}
+		if((start == 2 && path[0] == '.' && path[1] == '.') || start > DIR_ENTRY_FILE_NAME_SIZE - 1)
+			return -1;
+
+		if(length > 0)
+			normal[length++] = '/';
+		memcpy(&normal[length], path, start);
+		length += start;
+		path += start;
 	}
-
-	// return the index as a result of reading the FAT
-	return current_index;
+	normal[length] = '\0';
+	return length;
 }
 
 /*
-* Read the root directory as a file data table (FDT) 
-* and print its information if flagged to do so
+* Hash the "length" characters of a path (FNV-1a)
 */
-int read_FDT(unsigned char* map, int print)
+uint32_t hashPath(const char* path, int length)
 {
-	int current_block;
-	int current_index;
-	int end_index;
-	int entries_per_block;
-	int num_entries;
-	int offset;				// use this to jump to each field in the entry
-	int i,j;
-
-	current_block = FDT->start_block;
-	//printf("starting at block %d, current_index %d\n", current_block, current_block*BLOCK_SIZE);
-	end_index = (FDT->start_block + FDT->num_blocks)*BLOCK_SIZE;
-	entries_per_block = BLOCK_SIZE / DIR_ENTRY_SIZE;
-	num_entries = entries_per_block * FDT->num_blocks;
+	uint32_t hash = 2166136261u;
+	int i;
 
-	//printf("read_FDT: num_entries: %d, FDT->num_blocks: %d\n", num_entries, FDT->num_blocks);
+	for(i=0; i < length; i++)
+	{
+		hash ^= (unsigned char)path[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-	// Allocate memory for the list of root entries
-	FDT->root = (struct dirEntry*)malloc(sizeof(FDT->root)*num_entries);
+/*
+* Returns the opened directory of the "length" characters of "path", NULL
+*	if it is not cached. The caller holds dirs_lock
+*/
+struct FDT* cachedDirectory(struct disk_image* img, const char* path, int length)
+{
+	uint32_t mask = img->dir_slots_size - 1;
+	uint32_t slot = hashPath(path, length) & mask;
+	struct FDT* dir;
 
-	//printf("starting at block %d, current_index %d\n", current_block, current_block*BLOCK_SIZE);
-	// for each block in the FDT
-	for(i=0; i < FDT->num_blocks; i++)
+	while(img->dir_slots[slot] != 0)
 	{
-		current_index = current_block*BLOCK_SIZE;
-		//printf("current_index: %d\n", current_index);
-
-		// ensure current index is not at the end
-		if(current_index == end_index)
-			break;
+		dir = img->dirs[img->dir_slots[slot] - 1];
+		if(!strncmp(dir->path, path, length) && dir->path[length] == '\0')
+			return dir;
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
 
-		// for each entry in the current FDT block
-		for(j=0; j < entries_per_block; j++)
-		{
-			// reset the offset for new entries
-			offset = 0;
-
-			//printf("current_index: %d\n", current_index);
-
-			// read each field of the current dir entry into FDT's list of dir entries
-			//printf("FDT->root[dir_entries].status: %.2x\n", FDT->root[dir_entries].status);
-			//printf("map[current_index + offset]: %.2x\n", map[current_index + offset]);
-			// read status field
-			memcpy(&FDT->root[dir_entries].status, &map[current_index + offset], DIR_ENTRY_STATUS_SIZE);
-			//printf("status = %.2x\n",FDT->root[dir_entries].status);
-			offset += DIR_ENTRY_STATUS_SIZE;
-
-			// read starting block field
-			memcpy(&FDT->root[dir_entries].start_block, &map[current_index + offset], DIR_ENTRY_START_BLOCK_SIZE);
-			FDT->root[dir_entries].start_block = htonl(FDT->root[dir_entries].start_block);
-			offset += DIR_ENTRY_START_BLOCK_SIZE;
-			//printf("start block %10d\n", FDT->root[dir_entries].start_block);
-
-			// read number of blocks field
-			memcpy(&FDT->root[dir_entries].num_blocks, &map[current_index + offset], DIR_ENTRY_NUM_BLOCKS_SIZE);
-			FDT->root[dir_entries].num_blocks = htonl(FDT->root[dir_entries].num_blocks);
-			offset += DIR_ENTRY_NUM_BLOCKS_SIZE;
-			//printf("num_blocks %10d\n", FDT->root[dir_entries].num_blocks);
-
-			// read file size field
-			memcpy(&FDT->root[dir_entries].file_size, &map[current_index + offset], DIR_ENTRY_FILE_SIZE_B_SIZE);
-			FDT->root[dir_entries].file_size = htonl(FDT->root[dir_entries].file_size);
-			offset += DIR_ENTRY_FILE_SIZE_B_SIZE;
-			//printf("file_size %d\n", FDT->root[dir_entries].file_size);
-
-			// read create time field
-			// buffer to hold time fields
-			unsigned char buffer[DIR_ENTRY_FILE_NAME_SIZE+1];
-			memcpy(&buffer, &map[current_index + offset], DIR_ENTRY_CREATE_TIME_SIZE);
-			init_timeStruct(&FDT->root[dir_entries].create_time, buffer, DIR_ENTRY_CREATE_TIME_SIZE);
-			offset += DIR_ENTRY_CREATE_TIME_SIZE;
-			//printf("create_time %d\n", FDT->root[dir_entries].create_time);
-
-			// read modify time field
-			memcpy(&buffer, &map[current_index + offset], DIR_ENTRY_MODIFY_TIME_SIZE);
-			init_timeStruct(&FDT->root[dir_entries].modify_time, buffer, DIR_ENTRY_MODIFY_TIME_SIZE);
-			offset += DIR_ENTRY_MODIFY_TIME_SIZE;
-
-			// read filename field
-			memcpy(&FDT->root[dir_entries].filename, &map[current_index + offset], DIR_ENTRY_FILE_NAME_SIZE);
-			offset += DIR_ENTRY_FILE_NAME_SIZE;
-
-			if(j<5 && i<2)
-			{
-				//printf("dir entry %d %s use\n", dir_entries, dirEntryIsUsed(FDT->root[dir_entries].status)?"in" : "not in");
-			}
-			/* update first entry available to add new files in the future */
-            if (( !dirEntryIsUsed(FDT->root[dir_entries].status) ) && (firstRootEntryFree == -1) )
-            {
-                firstRootEntryFree = j;
-                firstRootEntryFreeBlock = current_block;
-            }
+/*
+* Add an opened directory to the path cache, so that the directories of a
+*	path are read once however deep it is. The caller holds dirs_lock
+*/
+void cacheDirectory(struct disk_image* img, struct FDT* dir)
+{
+	uint32_t mask;
+	uint32_t slot;
+	int i;
 
-			// print the fields read if flagged
-			if (print)
-            {
-                // print information on entries in use
-                if( dirEntryIsUsed(FDT->root[dir_entries].status) )
-                {
-                    printf("%c %10d %30s %4d/%02d/%02d %02d:%02d:%02d\n",
-                           dirEntryIsFile(FDT->root[dir_entries].status)?'F':'D',
-                           FDT->root[dir_entries].file_size,
-                           FDT->root[dir_entries].filename,
-                           FDT->root[dir_entries].modify_time.year,
-                           FDT->root[dir_entries].modify_time.month,
-                           FDT->root[dir_entries].modify_time.day,
-                           FDT->root[dir_entries].modify_time.hour,
-                           FDT->root[dir_entries].modify_time.minutes,
-                           FDT->root[dir_entries].modify_time.seconds);
-                }
-            }
+	if(img->num_dirs == img->dirs_capacity)
+	{
+		img->dirs_capacity = img->dirs_capacity? img->dirs_capacity * 2 : 16;
+		img->dirs = (struct FDT**)realloc(img->dirs, sizeof(struct FDT*) * img->dirs_capacity);
+	}
+	img->dirs[img->num_dirs++] = dir;
 
-            // go to next entry
-			current_index += DIR_ENTRY_SIZE;
-			// increase number of directory entries read so far
-			dir_entries++;
+	// keep the table at most half full
+	if((uint32_t)img->num_dirs * 2 > img->dir_slots_size)
+	{
+		free(img->dir_slots);
+		img->dir_slots_size = img->dir_slots_size? img->dir_slots_size * 2 : 32;
+		img->dir_slots = (int*)calloc(img->dir_slots_size, sizeof(int));
+		for(i=0; i < img->num_dirs - 1; i++)
+		{
+			slot = hashPath(img->dirs[i]->path, strlen(img->dirs[i]->path)) & (img->dir_slots_size - 1);
+			while(img->dir_slots[slot] != 0)
+				slot = (slot + 1) & (img->dir_slots_size - 1);
+			img->dir_slots[slot] = i + 1;
 		}
-
-		// go to next block
-		current_block++;
 	}
 
-	// retrun the index as a result of reading the FDT
-	return current_index;
-
+	mask = img->dir_slots_size - 1;
+	slot = hashPath(dir->path, strlen(dir->path)) & mask;
+	while(img->dir_slots[slot] != 0)
+		slot = (slot + 1) & mask;
+	img->dir_slots[slot] = img->num_dirs;
 }
 
 /*
-* Copy the file specified from the file system to the current directory by
-*	reading then writing each block
+* Set up "dir" as the directory made of the "num_blocks" blocks of
+*	"blocks", which it keeps, at "path" in "parent", and cache it
 */
-void get_file(unsigned char* map, char* imageFileName, char* outFileName)
+void initDirectory(struct disk_image* img, struct FDT* dir, uint32_t* blocks, uint32_t num_blocks,
+	const char* path, struct FDT* parent, int parent_entry)
 {
-    struct dirEntry* fileEntry = NULL; 
-    unsigned char buffer[BLOCK_SIZE];
-    int file_block = -1;
-    int fileSize = -1;
-    int blocks2Read = 0;
-    int remaining_bytes = 0;
-    int wfp;        
-    int current_index;
- 
+	dir->blocks = blocks;
+	dir->num_blocks = num_blocks;
+	dir->start_block = (num_blocks > 0)? blocks[0] : BLOCK_END;
+	dir->entries_per_block = img->fileSystem->block_size / DIR_ENTRY_SIZE;
+	dir->num_entries = dir->entries_per_block * num_blocks;
+	dir->shadow = (unsigned char**)calloc(num_blocks + 1, sizeof(unsigned char*));
+	dir->dirty_map = (uint64_t*)calloc(num_blocks / 64 + 1, sizeof(uint64_t));
+	dir->extent_cache = (struct extentIndex**)calloc(dir->num_entries + 1, sizeof(struct extentIndex*));
+	pthread_mutex_init(&dir->index_lock, NULL);
+	dir->path = strdup(path);
+	dir->parent = parent;
+	dir->parent_entry = parent_entry;
+	cacheDirectory(img, dir);
+}
 
-	read_superblock(map, 0);
-	read_FAT(map, 0);  
-	read_FDT(map, 0);
+/*
+* Open the subdirectory of the entry at "position" of "parent", or return
+*	it if it is already open. Returns NULL if its chain is broken. The
+*	caller holds dirs_lock
+*/
+struct FDT* childDirectory(struct disk_image* img, struct FDT* parent, int position)
+{
+	struct dirEntry* entry = dirEntryAt(img, parent, position);
+	struct extent* extents;
+	struct FDT* dir;
+	uint32_t* blocks;
+	uint32_t num_blocks = be32toh(entry->num_blocks);
+	uint32_t n = 0;
+	uint32_t j;
+	char* path;
+	int count;
+	int i;
 
-	if((fileEntry = findEntryInFDT(outFileName)) == NULL)
+	// the path of the child
+	path = (char*)malloc(strlen(parent->path) + DIR_ENTRY_FILE_NAME_SIZE + 2);
+	sprintf(path, "%s%s%.*s", parent->path, (parent->path[0] != '\0')? "/" : "",
+		DIR_ENTRY_FILE_NAME_SIZE, entry->filename);
+	if((dir = cachedDirectory(img, path, strlen(path))) != NULL)
 	{
-		printf("null file entry\n");
-		exit(-1);
+		free(path);
+		return dir;
 	}
 
-	// determine the entry point into the FAT
-    file_block = fileEntry->start_block;
-    // determine the file size
-    fileSize  = fileEntry->file_size;
+	if(num_blocks == 0 ||
+		(count = resolveExtents(img, be32toh(entry->start_block), num_blocks << img->fileSystem->block_shift, &extents)) < 0)
+	{
+		printf("error: the FAT chain of directory %s is broken\n", path);
+		free(path);
+		return NULL;
+	}
+	blocks = (uint32_t*)malloc(sizeof(uint32_t) * num_blocks);
+	for(i=0; i < count; i++)
+	{
+		for(j=0; j < extents[i].num_blocks; j++)
+			blocks[n++] = extents[i].start_block + j;
+	}
+	free(extents);
 
-    // determine values to read
-    blocks2Read    = (fileSize / BLOCK_SIZE);
-    remaining_bytes = (fileSize % BLOCK_SIZE);
+	dir = (struct FDT*)calloc(1, sizeof(struct FDT));
+	initDirectory(img, dir, blocks, num_blocks, path, parent, position);
+	free(path);
+	return dir;
+}
 
-    // init buffer to all 0's
-    memset(&buffer, 0, BLOCK_SIZE);
+/*
+* Returns 0 if the entries of "dir" may be changed, -1 if it is a root
+*	read without its broken chain: its blocks may belong to files
+*/
+int checkDirWritable(struct disk_image* img, struct FDT* dir)
+{
+	(void)img;
+	if(!dir->unchained)
+		return 0;
+	printf("error: the chain of the root directory is broken, run diskcheck\n");
+	return -1;
+}
+
+/*
+* Add an empty block to the end of directory "dir", which must be indexed,
+*	chained to its last block. The root directory grows the same way; the
+*	superblock records its new length when it is written back. Returns 0
+*	on success, -1 if there is no free block or the root's chain is broken
+*/
+int growDirectory(struct disk_image* img, struct FDT* dir)
+{
+	struct dirEntry* entry;
+	uint32_t length;
+	int block;
+	int i;
+
+	if(checkDirWritable(img, dir) < 0 || (block = allocFATRun(img, 1, &length)) == -1)
+		return -1;
+	setFATEntry(img, dir->blocks[dir->num_blocks - 1], block);
+	setFATEntry(img, block, BLOCK_END);
+
+	dir->blocks = (uint32_t*)realloc(dir->blocks, sizeof(uint32_t) * (dir->num_blocks + 1));
+	dir->shadow = (unsigned char**)realloc(dir->shadow, sizeof(unsigned char*) * (dir->num_blocks + 1));
+	if(dir->num_blocks % 64 == 0)
+	{
+		dir->dirty_map = (uint64_t*)realloc(dir->dirty_map, sizeof(uint64_t) * (dir->num_blocks / 64 + 1));
+		dir->dirty_map[dir->num_blocks / 64] = 0;
+	}
+	dir->blocks[dir->num_blocks] = block;
+	dir->shadow[dir->num_blocks] = (unsigned char*)calloc(1, img->fileSystem->block_size);
+	dir->dirty_map[dir->num_blocks / 64] |= (uint64_t)1 << (dir->num_blocks % 64);
+	dir->num_blocks++;
+
+	dir->extent_cache = (struct extentIndex**)realloc(dir->extent_cache,
+		sizeof(struct extentIndex*) * (dir->num_entries + dir->entries_per_block));
+	for(i=dir->num_entries + dir->entries_per_block - 1; i >= dir->num_entries; i--)
+	{
+		dir->extent_cache[i] = NULL;
+		pushFreeDirEntry(dir, i);
+	}
+	dir->num_entries += dir->entries_per_block;
+	growFDTIndex(img, dir);
+
+	// the entry of a subdirectory records its length
+	if(dir->parent == NULL)
+		return 0;
+	entry = writableDirEntry(img, dir->parent, dir->parent_entry);
+	entry->num_blocks = htobe32(dir->num_blocks);
+	entry->file_size = htobe32(dir->num_blocks << img->fileSystem->block_shift);
+	return 0;
+}
+
+/*
+* Create the directory "name" of "length" characters in "parent", made
+*	of one empty block. Returns the new directory, NULL if there is no room
+*/
+struct FDT* createDirectory(struct disk_image* img, struct FDT* parent, const char* name, int length)
+{
+	struct dirEntry* entry;
+	struct FDT* dir;
+	uint32_t run;
+	int position;
+	int block;
+
+	buildFDTIndex(img, parent);
+	if(checkDirWritable(img, parent) < 0 || length > DIR_ENTRY_FILE_NAME_SIZE - 1 ||
+		(parent->num_free == 0 && growDirectory(img, parent) < 0) ||
+		(block = allocFATRun(img, 1, &run)) == -1)
+	{
+		printf("error: could not create directory %.*s in /%s\n", length, name, parent->path);
+		return NULL;
+	}
+	setFATEntry(img, block, BLOCK_END);
+
+	position = popFreeDirEntry(parent);
+	entry = writableDirEntry(img, parent, position);
+	memset(entry, 0, sizeof(struct dirEntry));
+	entry->status = DIR_ENTRY_USED | DIR_ENTRY_DIRECTORY;
+	entry->start_block = htobe32(block);
+	entry->num_blocks = htobe32(1);
+	entry->file_size = htobe32(img->fileSystem->block_size);
+	memcpy(entry->filename, name, length);
+	memset(entry->unused, 0xFF, DIR_ENTRY_UNUSED_SIZE);
+	indexDirEntry(img, parent, position);
+
+	// its block starts empty, it is written by disk_sync
+	if((dir = childDirectory(img, parent, position)) == NULL)
+		return NULL;
+	free(dir->shadow[0]);
+	dir->shadow[0] = (unsigned char*)calloc(1, img->fileSystem->block_size);
+	dir->dirty_map[0] |= 1;
+	return dir;
+}
+
+/*
+* Returns the directory of the "length" characters of normalized "path",
+*	opening the directories along it that are not cached yet. With
+*	"create" the missing ones are created. Returns NULL if the path does
+*	not name a directory. The caller holds dirs_lock
+*/
+struct FDT* findDirectory(struct disk_image* img, const char* path, int length, bool create)
+{
+	struct dirEntry* entry;
+	struct FDT* parent;
+	struct FDT* dir;
+	int split;
+	int position;
+
+	if(length == 0)
+		return img->FDT;
+	if((dir = cachedDirectory(img, path, length)) != NULL)
+		return dir;
+
+	// the parent first, then the last component in it
+	for(split = length - 1; split >= 0 && path[split] != '/'; split--)
+		;
+	if((parent = findDirectory(img, path, (split > 0)? split : 0, create)) == NULL)
+		return NULL;
+
+	entry = findEntryInDir(img, parent, &path[split + 1], length - split - 1, &position);
+	if(entry == NULL)
+		return create? createDirectory(img, parent, &path[split + 1], length - split - 1) : NULL;
+	if(!dirEntryIsDirectory(entry->status))
+	{
+		if(create)
+			printf("error: /%.*s is not a directory\n", length, path);
+		return NULL;
+	}
+	return childDirectory(img, parent, position);
+}
+
+/*
+* Returns the directory at the "length" characters of normalized "path",
+*	see findDirectory
+*/
+struct FDT* lookupDirectory(struct disk_image* img, const char* path, int length, bool create)
+{
+	struct FDT* dir;
+
+	pthread_mutex_lock(&img->dirs_lock);
+	dir = findDirectory(img, path, length, create);
+	pthread_mutex_unlock(&img->dirs_lock);
+	return dir;
+}
+
+/*
+* Returns the directory entry at "path", a file or a directory, NULL if
+*	there is none. The directories along the path are cached, so deep
+*	paths do not read their parents again. The directory holding the
+*	entry and its position are stored in "parent" and "position"
+*/
+struct dirEntry* findEntryInPath(struct disk_image* img, const char* path, struct FDT** parent, int* position)
+{
+	struct dirEntry* cur_entry = NULL;
+	struct FDT* dir;
+	char* normal;
+	int length;
+	int split;
+	uint64_t start = PHASE_START(img->stats);
+
+	normal = (char*)malloc(strlen(path) + 1);
+	if((length = normalizePath(path, normal)) > 0)
+	{
+		for(split = length - 1; split >= 0 && normal[split] != '/'; split--)
+			;
+		if((dir = lookupDirectory(img, normal, (split > 0)? split : 0, false)) != NULL)
+			cur_entry = findEntryInDir(img, dir, &normal[split + 1], length - split - 1, position);
+		if(parent != NULL)
+			*parent = dir;
+	}
+	free(normal);
+
+	STAT_ADD(img->stats, COUNT_LOOKUPS, 1);
+	PHASE_STOP(img->stats, PHASE_LOOKUP, start);
+	return cur_entry;
+}
+
+/*
+* Returns the directory entry at "path", a file or a directory, NULL if
+*	there is none
+*/
+struct dirEntry* findEntryInFDT(struct disk_image* img, char* path)
+{
+	return findEntryInPath(img, path, NULL, NULL);
+}
+
+/*
+*	Mark the given block as free or in use in the free block bitmap
+*/
+void setBlockFree(struct disk_image* img, uint32_t block, bool is_free)
+{
+	uint64_t mask = (uint64_t)1 << (block % 64);
+
+	loadFATBlock(img, block >> img->FAT->entries_shift);
+
+	if(is_free)
+		img->FAT->free_map[block / 64] |= mask;
+	else
+		img->FAT->free_map[block / 64] &= ~mask;
+}
+
+/*
+*	Determine if the given block is marked free in the free block bitmap
+*/
+bool blockIsFree(struct disk_image* img, uint32_t block)
+{
+	loadFATBlock(img, block >> img->FAT->entries_shift);
+	return (img->FAT->free_map[block / 64] >> (block % 64)) & 1;
+}
+
+/*
+*	Return the first free block at or after "from", -1 if there is none.
+*	Whole bitmap words with no free blocks are skipped at once
+*/
+int findFreeBlock(struct disk_image* img, uint32_t from)
+{
+	uint32_t word;
+	uint64_t bits;
+
+	if(from >= img->FAT->num_entries)
+		return -1;
+
+	word = from / 64;
+	// ignore the blocks before "from" in the first word
+	loadFATBlock(img, (word*64) >> img->FAT->entries_shift);
+	bits = img->FAT->free_map[word] & (~(uint64_t)0 << (from % 64));
+
+	while(!bits)
+	{
+		if(++word >= (img->FAT->num_entries + 63) / 64)
+		{
+			STAT_ADD(img->stats, COUNT_FAT_SCANNED, (uint64_t)word*64 - from);
+			return -1;
+		}
+		loadFATBlock(img, (word*64) >> img->FAT->entries_shift);
+		bits = img->FAT->free_map[word];
+	}
+
+	STAT_ADD(img->stats, COUNT_FAT_SCANNED, (uint64_t)word*64 + __builtin_ctzll(bits) + 1 - from);
+	from = word*64 + __builtin_ctzll(bits);
+	return (from < img->FAT->num_entries)? (int)from : -1;
+}
+
+/*
+*	Return the length of the free run starting at "block", up to "limit" blocks
+*/
+uint32_t freeRunLength(struct disk_image* img, uint32_t block, uint32_t limit)
+{
+	uint32_t length = 0;
+
+	while(length < limit && block + length < img->FAT->num_entries &&
+		blockIsFree(img, block + length))
+	{
+		length++;
+	}
+	STAT_ADD(img->stats, COUNT_FAT_SCANNED, length + 1);
+	return length;
+}
+
+/*
+*	Search for a free run of at least "want" blocks in [from, to).
+*	Returns the first block of the run, -1 if there is none
+*/
+int findFreeRun(struct disk_image* img, uint32_t from, uint32_t to, uint32_t want)
+{
+	int block;
+	uint32_t length;
+
+	while(from < to && (block = findFreeBlock(img, from)) != -1 && (uint32_t)block < to)
+	{
+		length = freeRunLength(img, block, want);
+		if(length == want)
+			return block;
+		// the run is too short, continue after it
+		from = block + length;
+	}
+	return -1;
+}
+
+/*
+*	Allocate up to "want" free blocks as one contiguous run and mark them used.
+*	A run holding the whole request is preferred; when free space is too
+*	fragmented for that, the first free run after the cursor is taken instead.
+*	Both searches start at the "next free" cursor, so allocating a large file
+*	visits each FAT entry a bounded number of times instead of rescanning.
+*	Returns the first block of the run and stores its length in "length",
+*	-1 if the FAT has no free blocks left
+*/
+int allocFATRun(struct disk_image* img, uint32_t want, uint32_t* length)
+{
+	int block = -1;
+	uint32_t i;
+	uint64_t start;
+
+	if(want == 0 || length == NULL)
+		return -1;
+
+	// the free block count is only known once the whole FAT is decoded
+	if(img->FAT->decoded_blocks == img->FAT->num_blocks && img->FAT->free_blocks <= 0)
+		return -1;
+
+	start = PHASE_START(img->stats);
+
+	// look for a contiguous run, unless a previous search proved there is none
+	if(want < img->FAT->no_run_from)
+	{
+		block = findFreeRun(img, img->FAT->next_free, img->FAT->num_entries, want);
+		if(block == -1)
+			block = findFreeRun(img, 0, img->FAT->next_free, want);
+		if(block == -1)
+			img->FAT->no_run_from = want;
+	}
+
+	// fall back to the first free run after the cursor
+	if(block == -1)
+	{
+		block = findFreeBlock(img, img->FAT->next_free);
+		if(block == -1)
+			block = findFreeBlock(img, 0);
+		if(block == -1)
+		{
+			PHASE_STOP(img->stats, PHASE_ALLOC, start);
+			return -1;
+		}
+	}
+
+	*length = freeRunLength(img, block, want);
+	for(i=0; i < *length; i++)
+		setBlockFree(img, block + i, false);
+
+	img->FAT->free_blocks -= *length;
+	img->FAT->allocated_blocks += *length;
+	img->FAT->next_free = block + *length;
+
+	STAT_ADD(img->stats, COUNT_BLOCKS_ALLOCATED, *length);
+	PHASE_STOP(img->stats, PHASE_ALLOC, start);
+	return block;
+}
+
+/*
+*	Give back a run of blocks reserved by allocFATRun that was not used
+*/
+void releaseFATRun(struct disk_image* img, uint32_t block, uint32_t length)
+{
+	uint32_t i;
+
+	for(i=0; i < length; i++)
+		setBlockFree(img, block + i, true);
+
+	img->FAT->free_blocks += length;
+	img->FAT->allocated_blocks -= length;
+	img->FAT->no_run_from = UINT32_MAX;
+	if(block < img->FAT->next_free)
+		img->FAT->next_free = block;
+}
+/*
+*	Free a run of "length" blocks of a chain: their FAT entries become
+*	available and the blocks return to the free block bitmap
+*/
+void freeFATRun(struct disk_image* img, uint32_t block, uint32_t length)
+{
+	uint32_t i;
+
+	for(i=0; i < length; i++)
+		setFATEntry(img, block + i, BLOCK_AVAILABLE);
+	releaseFATRun(img, block, length);
+}
+
+/*
+*	Decode "count" big endian FAT entries from "src". Entry k is block
+*	"base + k": its bit is set in "free_map" when it is free and in
+*	"chain_map" when it points to block "base + k + 1". counts[0] and
+*	counts[1] are increased by the free and reserved entries
+*/
+void decodeFATScalar(const unsigned char* src, uint32_t base, uint32_t count,
+	uint64_t* free_map, uint64_t* chain_map, uint32_t* counts)
+{
+	uint32_t status;
+	uint32_t k;
+
+	for(k=0; k < count; k++)
+	{
+		memcpy(&status, &src[k*FAT_ENTRY_SIZE], FAT_ENTRY_SIZE);
+		status = ntohl(status);
+
+		if(status == BLOCK_AVAILABLE)
+		{
+			free_map[(base + k) / 64] |= (uint64_t)1 << ((base + k) % 64);
+			counts[0]++;
+		}
+		else if(status == BLOCK_RESERVED)
+		{
+			counts[1]++;
+		}
+		else if(status == base + k + 1)
+		{
+			chain_map[(base + k) / 64] |= (uint64_t)1 << ((base + k) % 64);
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+*	SSE2 version of decodeFATScalar, 8 entries at a time. "base" must be a
+*	multiple of 8 so that the 8 status bits land in one bitmap word
+*/
+__attribute__((target("sse2")))
+void decodeFATSSE2(const unsigned char* src, uint32_t base, uint32_t count,
+	uint64_t* free_map, uint64_t* chain_map, uint32_t* counts)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi32(BLOCK_RESERVED);
+	const __m128i four = _mm_set1_epi32(4);
+	__m128i a, b;
+	__m128i next;		// the block after each entry's own
+	uint32_t free_bits, reserved_bits, chain_bits;
+	uint32_t k;
+
+	next = _mm_setr_epi32(base + 1, base + 2, base + 3, base + 4);
+
+	for(k=0; k + 8 <= count; k += 8)
+	{
+		a = _mm_loadu_si128((const __m128i*)&src[k*FAT_ENTRY_SIZE]);
+		b = _mm_loadu_si128((const __m128i*)&src[k*FAT_ENTRY_SIZE + 16]);
+
+		// byte swap: swap the bytes of each 16 bit half, then the halves
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xB1), 0xB1);
+		b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, 0xB1), 0xB1);
+
+		// one bit per entry for each status of interest
+		free_bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, zero))) |
+			(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(b, zero))) << 4);
+		reserved_bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, one))) |
+			(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(b, one))) << 4);
+		chain_bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, next)));
+		next = _mm_add_epi32(next, four);
+		chain_bits |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(b, next))) << 4;
+		next = _mm_add_epi32(next, four);
+		// block 0 reserved reads as a link to block 1
+		chain_bits &= ~reserved_bits;
+
+		free_map[(base + k) / 64] |= (uint64_t)free_bits << ((base + k) % 64);
+		chain_map[(base + k) / 64] |= (uint64_t)chain_bits << ((base + k) % 64);
+		counts[0] += __builtin_popcount(free_bits);
+		counts[1] += __builtin_popcount(reserved_bits);
+	}
+
+	decodeFATScalar(&src[k*FAT_ENTRY_SIZE], base + k, count - k, free_map, chain_map, counts);
+}
+
+/*
+*	AVX2 version of decodeFATScalar, 16 entries at a time. "base" must be a
+*	multiple of 16 so that the 16 status bits land in one bitmap word
+*/
+__attribute__((target("avx2")))
+void decodeFATAVX2(const unsigned char* src, uint32_t base, uint32_t count,
+	uint64_t* free_map, uint64_t* chain_map, uint32_t* counts)
+{
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(BLOCK_RESERVED);
+	const __m256i eight = _mm256_set1_epi32(8);
+	__m256i a, b;
+	__m256i next;		// the block after each entry's own
+	uint32_t free_bits, reserved_bits, chain_bits;
+	uint32_t k;
+
+	next = _mm256_setr_epi32(base + 1, base + 2, base + 3, base + 4,
+		base + 5, base + 6, base + 7, base + 8);
+
+	for(k=0; k + 16 <= count; k += 16)
+	{
+		a = _mm256_loadu_si256((const __m256i*)&src[k*FAT_ENTRY_SIZE]);
+		b = _mm256_loadu_si256((const __m256i*)&src[k*FAT_ENTRY_SIZE + 32]);
+
+		// byte swap every entry
+		a = _mm256_shuffle_epi8(a, swap);
+		b = _mm256_shuffle_epi8(b, swap);
+
+		// one bit per entry for each status of interest
+		free_bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, zero))) |
+			(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(b, zero))) << 8);
+		reserved_bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, one))) |
+			(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(b, one))) << 8);
+		chain_bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, next)));
+		next = _mm256_add_epi32(next, eight);
+		chain_bits |= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(b, next))) << 8;
+		next = _mm256_add_epi32(next, eight);
+		// block 0 reserved reads as a link to block 1
+		chain_bits &= ~reserved_bits;
+
+		free_map[(base + k) / 64] |= (uint64_t)free_bits << ((base + k) % 64);
+		chain_map[(base + k) / 64] |= (uint64_t)chain_bits << ((base + k) % 64);
+		counts[0] += __builtin_popcount(free_bits);
+		counts[1] += __builtin_popcount(reserved_bits);
+	}
+
+	decodeFATScalar(&src[k*FAT_ENTRY_SIZE], base + k, count - k, free_map, chain_map, counts);
+}
+#endif
+
+/*
+*	Decode FAT entries with the widest kernel the CPU supports,
+*	see decodeFATScalar. The kernel is chosen on the first call
+*/
+void decodeFATEntries(const unsigned char* src, uint32_t base, uint32_t count,
+	uint64_t* free_map, uint64_t* chain_map, uint32_t* counts)
+{
+	if(decodeFAT == NULL)
+	{
+		decodeFAT = decodeFATScalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+			decodeFAT = decodeFATAVX2;
+		else if(__builtin_cpu_supports("sse2"))
+			decodeFAT = decodeFATSSE2;
+#endif
+	}
+
+	// the vector kernels need a 16 entry aligned start
+	if(base % 16)
+		decodeFATScalar(src, base, count, free_map, chain_map, counts);
+	else
+		decodeFAT(src, base, count, free_map, chain_map, counts);
+}
+
+/*
+*	Return the slot of "block" in the jump table, or of the empty slot
+*	where it would go. The caller holds jumps_lock
+*/
+uint32_t findJumpSlot(struct FAT* FAT, uint32_t block)
+{
+	uint32_t mask = ((uint32_t)1 << FAT->jumps_bits) - 1;
+	uint32_t slot = (block * 2654435761u) >> (32 - FAT->jumps_bits);
+
+	while(FAT->jumps[slot].value != BLOCK_AVAILABLE && FAT->jumps[slot].block != block)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/*
+*	Store the entry "value" of "block" in the jump table, growing it past
+*	3/4 full. The caller holds jumps_lock for writing
+*/
+void putJump(struct FAT* FAT, uint32_t block, uint32_t value)
+{
+	struct fatJump* old = FAT->jumps;
+	uint32_t old_size = (uint32_t)1 << FAT->jumps_bits;
+	uint32_t slot;
+	uint32_t i;
+
+	if((FAT->num_jumps + 1)*4 > old_size*3)
+	{
+		FAT->jumps_bits++;
+		FAT->jumps = (struct fatJump*)calloc((size_t)1 << FAT->jumps_bits, sizeof(struct fatJump));
+		for(i=0; i < old_size; i++)
+		{
+			if(old[i].value != BLOCK_AVAILABLE)
+				FAT->jumps[findJumpSlot(FAT, old[i].block)] = old[i];
+		}
+		free(old);
+	}
+
+	slot = findJumpSlot(FAT, block);
+	if(FAT->jumps[slot].value == BLOCK_AVAILABLE)
+		FAT->num_jumps++;
+	FAT->jumps[slot].block = block;
+	FAT->jumps[slot].value = value;
+}
+
+/*
+*	Remove "block" from the jump table, shifting back the entries that
+*	probed past it. The caller holds jumps_lock for writing
+*/
+void removeJump(struct FAT* FAT, uint32_t block)
+{
+	uint32_t mask = ((uint32_t)1 << FAT->jumps_bits) - 1;
+	uint32_t hole = findJumpSlot(FAT, block);
+	uint32_t slot = hole;
+	uint32_t home;
+
+	if(FAT->jumps[hole].value == BLOCK_AVAILABLE)
+		return;
+	FAT->num_jumps--;
+
+	for(;;)
+	{
+		slot = (slot + 1) & mask;
+		if(FAT->jumps[slot].value == BLOCK_AVAILABLE)
+			break;
+
+		// an entry stays if its home slot is after the hole
+		home = (FAT->jumps[slot].block * 2654435761u) >> (32 - FAT->jumps_bits);
+		if(((slot - home) & mask) < ((slot - hole) & mask))
+			continue;
+
+		FAT->jumps[hole] = FAT->jumps[slot];
+		hole = slot;
+	}
+	FAT->jumps[hole].value = BLOCK_AVAILABLE;
+}
+
+/*
+*	Return the FAT entry of "block", whose FAT block is decoded
+*/
+uint32_t fatEntryValue(struct disk_image* img, uint32_t block)
+{
+	uint32_t value;
+
+	if((img->FAT->chain_map[block / 64] >> (block % 64)) & 1)
+		return block + 1;
+	if(!((img->FAT->jump_map[block / 64] >> (block % 64)) & 1))
+		return BLOCK_AVAILABLE;
+
+	pthread_rwlock_rdlock(&img->FAT->jumps_lock);
+	value = img->FAT->jumps[findJumpSlot(img->FAT, block)].value;
+	pthread_rwlock_unlock(&img->FAT->jumps_lock);
+	return value;
+}
+
+/*
+*	Set a FAT entry in memory and mark its FAT block for write back
+*/
+void setFATEntry(struct disk_image* img, uint32_t block, uint32_t value)
+{
+	uint32_t fat_block = block >> img->FAT->entries_shift;
+	uint64_t bit = (uint64_t)1 << (block % 64);
+	bool in_table;
+
+	// the rest of the FAT block is written back with it
+	loadFATBlock(img, fat_block);
+	in_table = (img->FAT->jump_map[block / 64] & bit) != 0;
+
+	if(value >= BLOCK_MIN_ALLOCATED && value == block + 1)
+		img->FAT->chain_map[block / 64] |= bit;
+	else
+		img->FAT->chain_map[block / 64] &= ~bit;
+
+	if(value == BLOCK_AVAILABLE || (img->FAT->chain_map[block / 64] & bit))
+	{
+		if(in_table)
+		{
+			pthread_rwlock_wrlock(&img->FAT->jumps_lock);
+			removeJump(img->FAT, block);
+			pthread_rwlock_unlock(&img->FAT->jumps_lock);
+			img->FAT->jump_map[block / 64] &= ~bit;
+		}
+	}
+	else
+	{
+		pthread_rwlock_wrlock(&img->FAT->jumps_lock);
+		putJump(img->FAT, block, value);
+		pthread_rwlock_unlock(&img->FAT->jumps_lock);
+		img->FAT->jump_map[block / 64] |= bit;
+	}
+
+	img->FAT->dirty_map[fat_block / 64] |= (uint64_t)1 << (fat_block % 64);
+}
+
+/*
+*	Return the checksum of a journal: 64 bit FNV-1a, enough to tell a
+*	complete journal from one torn by a crash
+*/
+uint64_t journalChecksum(const unsigned char* buffer, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for(i=0; i < len; i++)
+	{
+		hash ^= buffer[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+*	Determine if disk_sync is gathering the metadata writes into the journal
+*/
+bool journalCollecting(struct disk_image* img)
+{
+	return img->journal != NULL && img->journal->collecting;
+}
+
+/*
+*	Append a record of "len" bytes at "offset" gathered from "iov"
+*/
+void journalAppend(struct journal* journal, struct iovec* iov, int iovcnt, off_t offset)
+{
+	struct journalRecord record;
+	size_t len = 0;
+	int i;
+
+	for(i=0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	// room for the record and the checksum that ends the journal
+	while(journal->size + sizeof(record) + len + sizeof(uint64_t) > journal->capacity)
+	{
+		journal->capacity *= 2;
+		journal->buffer = (unsigned char*)realloc(journal->buffer, journal->capacity);
+	}
+
+	record.offset = htobe64(offset);
+	record.length = htobe32(len);
+	memcpy(&journal->buffer[journal->size], &record, sizeof(record));
+	journal->size += sizeof(record);
+	for(i=0; i < iovcnt; i++)
+	{
+		memcpy(&journal->buffer[journal->size], iov[i].iov_base, iov[i].iov_len);
+		journal->size += iov[i].iov_len;
+	}
+	journal->records++;
+}
+
+/*
+*	Write metadata gathered from "iov" at "offset" of the disk image: into
+*	the journal while disk_sync collects a transaction, otherwise into the
+*	map when it is writable or with pwritev. Returns 0 on success, -1 on error
+*/
+int writeMetadata(struct disk_image* img, struct iovec* iov, int iovcnt, off_t offset)
+{
+	off_t position = offset;
+	int i;
+
+	if(journalCollecting(img))
+	{
+		journalAppend(img->journal, iov, iovcnt, offset);
+		return 0;
+	}
+
+	if(img->mapped_writes)
+	{
+		// a FAT run may already be encoded in place
+		for(i=0; i < iovcnt; i++)
+		{
+			if(iov[i].iov_base != &img->map[position])
+				memcpy(&img->map[position], iov[i].iov_base, iov[i].iov_len);
+			position += iov[i].iov_len;
+		}
+		return (img->msync_mode == MSYNC_NONE)? 0 : syncMapRange(img, offset, position - offset);
+	}
+
+	return pwritevFull(img->stats, img->fd, iov, iovcnt, offset);
+}
+
+/*
+*	Start gathering the metadata written by disk_sync into a transaction
+*/
+void beginJournal(struct disk_image* img)
+{
+	img->journal->size = sizeof(struct journalHeader);
+	img->journal->records = 0;
+	img->journal->collecting = 1;
+}
+
+/*
+*	Commit the transaction gathered since beginJournal. The data of the
+*	files is made durable, then the journal, and only then is the metadata
+*	written in place. Once that is durable too the journal is emptied; a
+*	crash at any point leaves either the old metadata or a journal that
+*	disk_open replays. Returns 0 on success, -1 on error
+*/
+int commitJournal(struct disk_image* img)
+{
+	struct journal* journal = img->journal;
+	struct journalHeader header;
+	struct journalRecord record;
+	struct iovec iov;
+	uint64_t checksum;
+	size_t position;
+	uint64_t start;
+
+	journal->collecting = 0;
+	if(journal->records == 0)
+		return 0;
+
+	start = PHASE_START(img->stats);
+	if(journal->fd < 0 &&
+		(journal->fd = open(journal->path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+	{
+		printf("error: could not create %s\n", journal->path);
+		PHASE_STOP(img->stats, PHASE_JOURNAL, start);
+		return -1;
+	}
+
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.records = htobe32(journal->records);
+	header.length = htobe64(journal->size - sizeof(header));
+	memcpy(journal->buffer, &header, sizeof(header));
+	checksum = htobe64(journalChecksum(journal->buffer, journal->size));
+	memcpy(&journal->buffer[journal->size], &checksum, sizeof(checksum));
+
+	// the data, then the journal
+	STAT_ADD(img->stats, COUNT_SYSCALLS, 2);
+	if(fdatasync(img->fd) < 0 ||
+		pwriteFull(img->stats, journal->fd, journal->buffer, journal->size + sizeof(checksum), 0) < 0 ||
+		fdatasync(journal->fd) < 0)
+	{
+		printf("error: could not write %s\n", journal->path);
+		PHASE_STOP(img->stats, PHASE_JOURNAL, start);
+		return -1;
+	}
+	journal->pending = 1;
+
+	// the metadata in place
+	for(position = sizeof(header); position < journal->size; position += iov.iov_len)
+	{
+		memcpy(&record, &journal->buffer[position], sizeof(record));
+		position += sizeof(record);
+		iov.iov_base = &journal->buffer[position];
+		iov.iov_len = be32toh(record.length);
+		if(writeMetadata(img, &iov, 1, be64toh(record.offset)) < 0)
+		{
+			PHASE_STOP(img->stats, PHASE_JOURNAL, start);
+			return -1;
+		}
+	}
+
+	// the transaction is complete once the metadata is durable
+	STAT_ADD(img->stats, COUNT_SYSCALLS, 2);
+	if(fdatasync(img->fd) < 0 || ftruncate(journal->fd, 0) < 0)
+	{
+		PHASE_STOP(img->stats, PHASE_JOURNAL, start);
+		return -1;
+	}
+	journal->pending = 0;
+	PHASE_STOP(img->stats, PHASE_JOURNAL, start);
+	return 0;
+}
+
+/*
+*	Finish the transaction of a journal left by a crash: if the journal of
+*	the disk image is complete, write its records in place, otherwise the
+*	metadata was never touched and the journal is dropped. Unless
+*	"writable", the image and the journal are left as they are: a torn
+*	journal is ignored and a complete one is an error, the metadata in
+*	place being older than it. Returns 0 on success or when there is no
+*	journal, -1 on error
+*/
+int replayJournal(const char* path, struct diskStats* stats, int writable)
+{
+	struct journalHeader header;
+	struct journalRecord record;
+	struct stat journalStats, imageStats;
+	unsigned char* buffer;
+	uint64_t checksum;
+	size_t position;
+	size_t length;
+	char* journal_path;
+	int jfd, fd = -1;
+	int status = -1;
+	uint64_t start = PHASE_START(stats);
+
+	journal_path = (char*)malloc(strlen(path) + sizeof(JOURNAL_SUFFIX));
+	sprintf(journal_path, "%s%s", path, JOURNAL_SUFFIX);
+	if((jfd = open(journal_path, O_RDONLY)) < 0)
+	{
+		free(journal_path);
+		return 0;
+	}
+
+	// read the whole journal and check that it is complete
+	fstat(jfd, &journalStats);
+	length = journalStats.st_size;
+	buffer = (unsigned char*)malloc(length + 1);
+	if(length < sizeof(header) + sizeof(checksum) || readFull(stats, jfd, buffer, length) != (ssize_t)length)
+		length = 0;
+	if(length > 0)
+	{
+		memcpy(&header, buffer, sizeof(header));
+		memcpy(&checksum, &buffer[length - sizeof(checksum)], sizeof(checksum));
+		if(memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) ||
+			be64toh(header.length) != length - sizeof(header) - sizeof(checksum) ||
+			be64toh(checksum) != journalChecksum(buffer, length - sizeof(checksum)))
+		{
+			length = 0;
+		}
+	}
+	close(jfd);
+
+	if(length == 0)
+	{
+		// torn before its commit: the metadata in place is the old one
+		status = 0;
+		goto done;
+	}
+	if(!writable)
+	{
+		printf("error: %s has a pending journal, open it for writing to replay it\n", path);
+		goto done;
+	}
+
+	if((fd = open(path, O_RDWR)) < 0 || fstat(fd, &imageStats) < 0)
+	{
+		printf("error: could not open %s to replay %s\n", path, journal_path);
+		goto done;
+	}
+	length -= sizeof(checksum);
+	for(position = sizeof(header); position + sizeof(record) <= length; position += be32toh(record.length))
+	{
+		memcpy(&record, &buffer[position], sizeof(record));
+		position += sizeof(record);
+		if(position + be32toh(record.length) > length ||
+			be64toh(record.offset) + be32toh(record.length) > (uint64_t)imageStats.st_size)
+		{
+			printf("error: %s does not match %s\n", journal_path, path);
+			goto done;
+		}
+		if(pwriteFull(stats, fd, &buffer[position], be32toh(record.length), be64toh(record.offset)) < 0)
+			goto done;
+	}
+	STAT_ADD(stats, COUNT_SYSCALLS, 1);
+	if(fdatasync(fd) < 0)
+		goto done;
+	status = 0;
+
+done:
+	// the journal is applied or was never committed
+	if(status == 0 && writable)
+		unlink(journal_path);
+	if(fd >= 0)
+		close(fd);
+	free(buffer);
+	free(journal_path);
+	PHASE_STOP(stats, PHASE_JOURNAL, start);
+	return status;
+}
+
+/*
+*	Write every modified FAT block back to the disk image. Consecutive
+*	modified blocks are encoded together and written with one write.
+*	Returns 0 on success, -1 on error
+*/
+int flush_FAT(struct disk_image* img)
+{
+	unsigned char* buffer;
+	unsigned char* target;
+	struct iovec iov;
+	uint32_t stage_blocks = STAGE_BYTES >> img->fileSystem->block_shift;
+	uint32_t first, last;
+	uint32_t i;
+	uint32_t value;
+	off_t offset;
+	size_t len;
+	uint64_t start = PHASE_START(img->stats);
+
+	buffer = NULL;
+
+	first = 0;
+	while(first < img->FAT->num_blocks)
+	{
+		// find the next run of modified FAT blocks
+		if(!((img->FAT->dirty_map[first / 64] >> (first % 64)) & 1))
+		{
+			first++;
+			continue;
+		}
+		last = first;
+		while(last + 1 < img->FAT->num_blocks && last + 1 - first < stage_blocks &&
+			((img->FAT->dirty_map[(last + 1) / 64] >> ((last + 1) % 64)) & 1))
+		{
+			last++;
+		}
+
+		// encode the run's entries in network order, in place when the map
+		// is writable and the run does not go through the journal
+		offset = blockOffset(img, img->FAT->start_block + first);
+		len = (size_t)(last - first + 1) << img->fileSystem->block_shift;
+		if(img->mapped_writes && !journalCollecting(img))
+			target = &img->map[offset];
+		else
+		{
+			if(buffer == NULL)
+				buffer = (unsigned char*)malloc(STAGE_BYTES);
+			target = buffer;
+		}
+		for(i=0; i < (last - first + 1)*img->FAT->entries_per_block; i++)
+		{
+			value = htonl(fatEntryValue(img, first*img->FAT->entries_per_block + i));
+			memcpy(&target[i*FAT_ENTRY_SIZE], &value, FAT_ENTRY_SIZE);
+		}
+
+		iov.iov_base = target;
+		iov.iov_len = len;
+		if(writeMetadata(img, &iov, 1, offset) < 0)
+		{
+			free(buffer);
+			PHASE_STOP(img->stats, PHASE_FAT_FLUSH, start);
+			return -1;
+		}
+		STAT_ADD(img->stats, COUNT_BYTES_WRITTEN, (uint64_t)(last - first + 1) << img->fileSystem->block_shift);
+
+		// the run is clean again
+		for(i=first; i <= last; i++)
+			img->FAT->dirty_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+		first = last + 1;
+	}
+
+	free(buffer);
+	PHASE_STOP(img->stats, PHASE_FAT_FLUSH, start);
+	return 0;
+}
+
+/*
+* Convert an on-disk time to seconds since the epoch (UTC), 0 if it is unset
+*/
+time_t mktimeStruct(const struct diskTime* timeP)
+{
+	struct tm tm;
+
+	if(timeP->year == 0)
+		return 0;
+
+	memset(&tm, 0, sizeof(struct tm));
+	tm.tm_year = be16toh(timeP->year) - 1900;
+	tm.tm_mon = timeP->month - 1;
+	tm.tm_mday = timeP->day;
+	tm.tm_hour = timeP->hour;
+	tm.tm_min = timeP->minutes;
+	tm.tm_sec = timeP->seconds;
+	return timegm(&tm);
+}
+
+/*
+*	Write every modified block of directory "dir" back to the disk image, one
+*	write per run of modified blocks that are also consecutive on the disk.
+*	The map then shows the new entries and the copies are dropped. Returns
+*	0 on success, -1 on error
+*/
+int flushDirectory(struct disk_image* img, struct FDT* dir)
+{
+	struct iovec* iov = NULL;
+	uint32_t first, last;
+	uint32_t i;
+
+	first = 0;
+	while(first < dir->num_blocks)
+	{
+		// find the next run of modified blocks
+		if(!((dir->dirty_map[first / 64] >> (first % 64)) & 1))
+		{
+			first++;
+			continue;
+		}
+		last = first;
+		while(last + 1 < dir->num_blocks &&
+			dir->blocks[last + 1] == dir->blocks[last] + 1 &&
+			((dir->dirty_map[(last + 1) / 64] >> ((last + 1) % 64)) & 1))
+		{
+			last++;
+		}
+
+		// gather the copies of the run
+		iov = (struct iovec*)realloc(iov, sizeof(struct iovec) * (last - first + 1));
+		for(i=first; i <= last; i++)
+		{
+			iov[i - first].iov_base = dir->shadow[i];
+			iov[i - first].iov_len = img->fileSystem->block_size;
+		}
+
+		if(writeMetadata(img, iov, last - first + 1, blockOffset(img, dir->blocks[first])) < 0)
+		{
+			free(iov);
+			return -1;
+		}
+		STAT_ADD(img->stats, COUNT_BYTES_WRITTEN, (uint64_t)(last - first + 1) << img->fileSystem->block_shift);
+
+		// the run is clean again
+		for(i=first; i <= last; i++)
+		{
+			dir->dirty_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+			free(dir->shadow[i]);
+			dir->shadow[i] = NULL;
+		}
+		first = last + 1;
+	}
+
+	free(iov);
+	return 0;
+}
+
+/*
+*	Write the modified blocks of every opened directory back to the disk
+*	image, and the length of the root directory to the superblock when it
+*	has grown. Returns 0 on success, -1 on error
+*/
+int flush_FDT(struct disk_image* img)
+{
+	const struct diskSuperblock* superblock = (const struct diskSuperblock*)img->map;
+	struct iovec iov;
+	uint32_t root_blocks;
+	int status = 0;
+	int i;
+	uint64_t start = PHASE_START(img->stats);
+
+	// the subdirectories were opened after their parents, write them first
+	for(i=img->num_dirs - 1; i >= 0 && status == 0; i--)
+		status = flushDirectory(img, img->dirs[i]);
+
+	if(status == 0 && img->num_dirs > 0 && be32toh(superblock->root_blocks) != img->FDT->num_blocks)
+	{
+		root_blocks = htobe32(img->FDT->num_blocks);
+		iov.iov_base = &root_blocks;
+		iov.iov_len = sizeof(uint32_t);
+		status = writeMetadata(img, &iov, 1, offsetof(struct diskSuperblock, root_blocks));
+		STAT_ADD(img->stats, COUNT_BYTES_WRITTEN, sizeof(uint32_t));
+	}
+
+	PHASE_STOP(img->stats, PHASE_FDT_FLUSH, start);
+	return status;
+}
+
+/*
+* Free allocated memory
+*/
+void free_fileSystem(struct disk_image* img)
+{
+	free(img->fileSystem);
+}
+void free_FAT(struct disk_image* img)
+{
+	free(img->FAT->free_map);
+	free(img->FAT->dirty_map);
+	free(img->FAT->valid_map);
+	pthread_mutex_destroy(&img->FAT->lock);
+	free(img->FAT->chain_map);
+	free(img->FAT->jump_map);
+	free(img->FAT->jumps);
+	pthread_rwlock_destroy(&img->FAT->jumps_lock);
+	free(img->FAT);
+}
+void freeDirectory(struct FDT* dir)
+{
+	uint32_t i;
+
+	for(i=0; i < dir->num_blocks; i++)
+		free(dir->shadow[i]);
+	for(i=0; i < (uint32_t)dir->num_entries; i++)
+		freeExtentIndex(dir->extent_cache[i]);
+	free(dir->extent_cache);
+	free(dir->shadow);
+	free(dir->blocks);
+	free(dir->index);
+	free(dir->free_slots);
+	free(dir->dirty_map);
+	free(dir->path);
+	pthread_mutex_destroy(&dir->index_lock);
+	free(dir);
+}
+void free_FDT(struct disk_image* img)
+{
+	int i;
+
+	// the root directory is not opened until read_FDT
+	if(img->num_dirs == 0)
+		free(img->FDT);
+	for(i=0; i < img->num_dirs; i++)
+		freeDirectory(img->dirs[i]);
+	free(img->dirs);
+	free(img->dir_slots);
+	img->dirs = NULL;
+	img->dir_slots = NULL;
+	img->num_dirs = 0;
+}
+
+/*
+* Close every subdirectory and drop the filename index of the root
+*	directory, once their changes are written back
+*/
+void forgetDirectories(struct disk_image* img)
+{
+	int i;
+
+	for(i=1; i < img->num_dirs; i++)
+		freeDirectory(img->dirs[i]);
+	memset(img->dir_slots, 0, sizeof(int) * img->dir_slots_size);
+	img->num_dirs = 0;
+	cacheDirectory(img, img->FDT);
+
+	free(img->FDT->index);
+	img->FDT->index = NULL;
+	img->FDT->indexed = 0;
+}
+
+/* Store the superblock's fields into the correct struct.
+*	Returns -1 if the block size is not supported
+*/
+int read_superblock(struct disk_image* img)
+{
+	const struct diskSuperblock* superblock = (const struct diskSuperblock*)img->map;
+
+	// Allocate memory for the file system structs
+	img->FAT = (struct FAT*)calloc(1, sizeof(struct FAT));
+	img->FDT = (struct FDT*)calloc(1, sizeof(struct FDT));
+	img->fileSystem = (struct fileSystem*)calloc(1, sizeof(struct fileSystem));
+
+	// The fields are read in place, they are big endian
+	img->fileSystem->block_size = be16toh(superblock->block_size);
+	img->fileSystem->num_blocks = be32toh(superblock->num_blocks);
+	img->FAT->start_block = be32toh(superblock->fat_start);
+	img->FAT->num_blocks = be32toh(superblock->fat_blocks);
+	img->FDT->start_block = be32toh(superblock->root_start);
+	img->FDT->num_blocks = be32toh(superblock->root_blocks);
+
+	// Derive the geometry from the block size, which must be a power of 2
+	if(img->fileSystem->block_size < MIN_BLOCK_SIZE || img->fileSystem->block_size > MAX_BLOCK_SIZE ||
+		(img->fileSystem->block_size & (img->fileSystem->block_size - 1)))
+	{
+		printf("error: unsupported block size %d\n", img->fileSystem->block_size);
+		return -1;
+	}
+	img->fileSystem->block_shift = __builtin_ctz(img->fileSystem->block_size);
+	img->FAT->entries_per_block = img->fileSystem->block_size / FAT_ENTRY_SIZE;
+	img->FAT->entries_shift = __builtin_ctz(img->FAT->entries_per_block);
+	img->FDT->entries_per_block = img->fileSystem->block_size / DIR_ENTRY_SIZE;
+
+	// return the current index as a result of reading the map
+	return sizeof(struct diskSuperblock);
+
+}
+
+/*
+* Set up the FAT without decoding it. Its blocks are decoded on demand by
+*	loadFATBlock, so opening an image costs the same whatever its size
+*/
+void init_FAT(struct disk_image* img)
+{
+	uint32_t total_entries;
+
+	total_entries = img->FAT->num_blocks*img->FAT->entries_per_block;
+
+	// Initialize the bitmaps and the jump table holding the entries
+	img->FAT->chain_map = (uint64_t*)calloc((total_entries + 63) / 64, sizeof(uint64_t));
+	img->FAT->jump_map = (uint64_t*)calloc((total_entries + 63) / 64, sizeof(uint64_t));
+	img->FAT->jumps_bits = 10;
+	img->FAT->jumps = (struct fatJump*)calloc((size_t)1 << img->FAT->jumps_bits, sizeof(struct fatJump));
+	img->FAT->num_jumps = 0;
+	pthread_rwlock_init(&img->FAT->jumps_lock, NULL);
+
+	// Only the entries that map to blocks of the file system can be allocated
+	img->FAT->num_entries = total_entries;
+	if(img->fileSystem->num_blocks > 0 && (uint32_t)img->fileSystem->num_blocks < img->FAT->num_entries)
+		img->FAT->num_entries = img->fileSystem->num_blocks;
+
+	// Initialize the free block bitmap, filled in as the blocks are decoded
+	img->FAT->free_map = (uint64_t*)calloc((total_entries + 63) / 64, sizeof(uint64_t));
+	img->FAT->next_free = 0;
+	img->FAT->no_run_from = UINT32_MAX;
+	img->FAT->dirty_map = (uint64_t*)calloc((img->FAT->num_blocks + 63) / 64, sizeof(uint64_t));
+	img->FAT->valid_map = (uint64_t*)calloc((img->FAT->num_blocks + 63) / 64, sizeof(uint64_t));
+	img->FAT->decoded_blocks = 0;
+	pthread_mutex_init(&img->FAT->lock, NULL);
+}
+
+/*
+* Decode the "count" FAT blocks from "first" that are not decoded yet,
+*	recording their entry statistics. The caller holds FAT->lock
+*/
+void decodeFATBlocks(struct disk_image* img, uint32_t first, uint32_t count)
+{
+	uint32_t counts[2] = {0, 0};	// free and reserved entries
+	const unsigned char* src;
+	uint32_t last;
+	uint32_t base;
+	uint32_t end;
+	uint32_t value;
+	uint64_t others;
+	uint32_t i;
+	uint64_t start = PHASE_START(img->stats);
+
+	while(count > 0)
+	{
+		// skip the decoded blocks
+		if((img->FAT->valid_map[first / 64] >> (first % 64)) & 1)
+		{
+			first++;
+			count--;
+			continue;
+		}
+
+		// decode the run of blocks that are not, in one go
+		last = first;
+		while(last + 1 < first + count &&
+			!((img->FAT->valid_map[(last + 1) / 64] >> ((last + 1) % 64)) & 1))
+		{
+			last++;
+		}
+
+		base = first*img->FAT->entries_per_block;
+		end = (last + 1)*img->FAT->entries_per_block;
+		src = &img->map[blockOffset(img, img->FAT->start_block + first)];
+		counts[0] = counts[1] = 0;
+		decodeFATEntries(src, base, end - base, img->FAT->free_map, img->FAT->chain_map, counts);
+
+		// the entries neither free nor linked to the next block go to the jump table
+		pthread_rwlock_wrlock(&img->FAT->jumps_lock);
+		for(i=base; i < end; i += 64)
+		{
+			others = ~(img->FAT->free_map[i / 64] | img->FAT->chain_map[i / 64]);
+			while(others)
+			{
+				memcpy(&value, &src[(i - base + __builtin_ctzll(others))*FAT_ENTRY_SIZE], FAT_ENTRY_SIZE);
+				putJump(img->FAT, i + __builtin_ctzll(others), ntohl(value));
+				others &= others - 1;
+			}
+			img->FAT->jump_map[i / 64] = ~(img->FAT->free_map[i / 64] | img->FAT->chain_map[i / 64]);
+		}
+		pthread_rwlock_unlock(&img->FAT->jumps_lock);
+
+		img->FAT->free_blocks += counts[0];
+		img->FAT->reserved_blocks += counts[1];
+		img->FAT->allocated_blocks += (last - first + 1)*img->FAT->entries_per_block - counts[0] - counts[1];
+
+		// Entries past the end of the file system can never be allocated
+		for(i=base; i < (last + 1)*img->FAT->entries_per_block; i++)
+		{
+			if(i >= img->FAT->num_entries)
+				img->FAT->free_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+		}
+
+		// publish the decoded blocks to the threads checking without the lock
+		for(i=first; i <= last; i++)
+			__atomic_or_fetch(&img->FAT->valid_map[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELEASE);
+		img->FAT->decoded_blocks += last - first + 1;
+		STAT_ADD(img->stats, COUNT_FAT_DECODED, (uint64_t)(last - first + 1)*img->FAT->entries_per_block);
+
+		count -= last - first + 1;
+		first = last + 1;
+	}
+	PHASE_STOP(img->stats, PHASE_FAT_DECODE, start);
+}
+
+/*
+* Make sure FAT block "fat_block" is decoded
+*/
+void loadFATBlock(struct disk_image* img, uint32_t fat_block)
+{
+	uint64_t bit = (uint64_t)1 << (fat_block % 64);
+
+	if(__atomic_load_n(&img->FAT->valid_map[fat_block / 64], __ATOMIC_ACQUIRE) & bit)
+		return;
+
+	pthread_mutex_lock(&img->FAT->lock);
+	decodeFATBlocks(img, fat_block, 1);
+	pthread_mutex_unlock(&img->FAT->lock);
+}
+
+/*
+* Return the FAT entry of "block". A FAT block that is not decoded has not
+*	been modified either, so its entry is read straight from the map
+*/
+uint32_t getFATEntry(struct disk_image* img, uint32_t block)
+{
+	uint32_t fat_block = block >> img->FAT->entries_shift;
+	const uint32_t* entries;
+
+	if(!(__atomic_load_n(&img->FAT->valid_map[fat_block / 64], __ATOMIC_ACQUIRE) & ((uint64_t)1 << (fat_block % 64))))
+	{
+		entries = (const uint32_t*)(img->map + blockOffset(img, img->FAT->start_block));
+		return be32toh(entries[block]);
+	}
+	return fatEntryValue(img, block);
+}
+
+/*
+* Return the number of blocks, up to "limit", of the run of consecutive
+*	blocks chained from "block": all but the last point to the block after
+*	them. 64 entries are checked at a time
+*/
+uint32_t chainRunLength(struct disk_image* img, uint32_t block, uint32_t limit)
+{
+	uint32_t length = 0;	// chained blocks, the run's last block excluded
+	uint32_t current;
+	uint32_t shift;
+	uint32_t n;
+	uint64_t bits;
+
+	if(limit > img->FAT->num_entries - block)
+		limit = img->FAT->num_entries - block;
+
+	while(length + 1 < limit)
+	{
+		current = block + length;
+		loadFATBlock(img, current >> img->FAT->entries_shift);
+
+		// the chained entries from "current" are the low set bits
+		shift = current % 64;
+		bits = ~(img->FAT->chain_map[current / 64] >> shift);
+		n = bits? (uint32_t)__builtin_ctzll(bits) : 64;
+		length += n;
+		if(n < 64 - shift)
+			break;
+	}
+	return (length + 1 < limit)? length + 1 : limit;
+}
+
+/*
+* Decode every FAT block not decoded yet, so that the entry statistics
+*	cover the whole FAT
+*/
+int read_FAT(struct disk_image* img)
+{
+	pthread_mutex_lock(&img->FAT->lock);
+	decodeFATBlocks(img, 0, img->FAT->num_blocks);
+	pthread_mutex_unlock(&img->FAT->lock);
+
+	// return the index as a result of reading the FAT
+	return blockOffset(img, img->FAT->start_block + img->FAT->num_blocks);
+}
+
+/*
+* Set up the root directory as a file data table (FDT). The entries are
+*	used in place in the map, nothing is copied; the filename index is
+*	built by the first lookup. Subdirectories are opened by path lookups.
+*	Returns 0 on success, -1 if the root directory is outside the image
+*/
+int read_FDT(struct disk_image* img)
+{
+	uint32_t* blocks;
+	uint32_t block = img->FDT->start_block;
+	uint32_t i;
+	int unchained;
+
+	// the root directory is chained like a file: contiguous as formatted,
+	// anywhere once it has grown. An image whose root chain is damaged is
+	// read as the contiguous blocks it was formatted with; past those they
+	// may belong to files, so such a root is not written, see checkDirWritable
+	blocks = (uint32_t*)malloc(sizeof(uint32_t) * (img->FDT->num_blocks + 1));
+	for(i=0; i < img->FDT->num_blocks; i++)
+	{
+		blocks[i] = block;
+		if(block >= img->FAT->num_entries || (block = getFATEntry(img, block)) < BLOCK_MIN_ALLOCATED ||
+			(i + 1 < img->FDT->num_blocks && block >= img->FAT->num_entries))
+		{
+			break;
+		}
+	}
+	unchained = (i < img->FDT->num_blocks);
+	if(unchained)
+	{
+		for(i=0; i < img->FDT->num_blocks; i++)
+			blocks[i] = img->FDT->start_block + i;
+	}
+
+	for(i=0; i < img->FDT->num_blocks; i++)
+	{
+		if(blockOffset(img, (uint64_t)blocks[i] + 1) > (off_t)img->map_size)
+		{
+			free(blocks);
+			return -1;
+		}
+	}
+	initDirectory(img, img->FDT, blocks, img->FDT->num_blocks, "", NULL, -1);
+	img->FDT->unchained = unchained;
+	return 0;
+}
+
+/*
+* Resolve the FAT chain of a file of "file_size" bytes starting at
+*	"start_block" into runs of consecutive blocks. The extent array is
+*	allocated and stored in "extents". Returns the number of extents,
+*	-1 if the chain is broken
+*/
+int resolveExtents(struct disk_image* img, uint32_t start_block, uint32_t file_size, struct extent** extents)
+{
+	struct extent* list;
+	uint32_t blocks;
+	uint32_t block = start_block;
+	uint32_t length;
+	int count = 0;
+	uint32_t i;
+	uint64_t start = PHASE_START(img->stats);
+
+	blocks = blocksForBytes(img, file_size);
+	list = (struct extent*)malloc(sizeof(struct extent) * (blocks + 1));
+
+	for(i=0; i < blocks; i += length)
+	{
+		// every block of the file must be inside the FAT
+		if(block >= img->FAT->num_entries)
+		{
+			free(list);
+			PHASE_STOP(img->stats, PHASE_CHAIN_WALK, start);
+			return -1;
+		}
+
+		// the whole run of chained blocks is one extent
+		length = chainRunLength(img, block, blocks - i);
+		list[count].start_block = block;
+		list[count].num_blocks = length;
+		count++;
+
+		// jump to the next run; a free or reserved entry breaks the chain,
+		// it would point at the metadata
+		if(i + length < blocks)
+		{
+			block = getFATEntry(img, block + length - 1);
+			if(block < BLOCK_MIN_ALLOCATED || block > BLOCK_MAX_ALLOCATED)
+			{
+				free(list);
+				PHASE_STOP(img->stats, PHASE_CHAIN_WALK, start);
+				return -1;
+			}
+		}
+	}
+
+	STAT_ADD(img->stats, COUNT_CHAIN_HOPS, blocks);
+	PHASE_STOP(img->stats, PHASE_CHAIN_WALK, start);
+	*extents = list;
+	return count;
+}
+
+/*
+* Split the FAT into runs of consecutive chained blocks in a single pass in
+*	block order. A run ends at the first block that does not point to the
+*	block after it, and "next" keeps what that block points to. The free
+*	runs are measured into "report" in the same pass. The runs are stored in
+*	"runs" sorted by block; returns their number
+*/
+uint32_t scanFATRuns(struct disk_image* img, struct extent** runs, uint32_t** next, struct fragReport* report)
+{
+	uint32_t num_runs = 0;
+	uint32_t capacity = 1024;
+	uint32_t free_length = 0;
+	uint32_t block;
+	uint32_t value;
+	int bucket;
+	bool in_run = false;
+
+	// every entry is needed
+	read_FAT(img);
+
+	memset(report, 0, sizeof(struct fragReport));
+	*runs = (struct extent*)malloc(sizeof(struct extent) * capacity);
+	*next = (uint32_t*)malloc(sizeof(uint32_t) * capacity);
+
+	for(block=0; block <= img->FAT->num_entries; block++)
+	{
+		// whole words of free blocks or of blocks inside a run are skipped
+		if(block % 64 == 0 && block + 64 <= img->FAT->num_entries)
+		{
+			if(free_length > 0 && !(img->FAT->chain_map[block / 64] | img->FAT->jump_map[block / 64]))
+			{
+				free_length += 64;
+				block += 63;
+				continue;
+			}
+			if(in_run && img->FAT->chain_map[block / 64] == ~(uint64_t)0)
+			{
+				(*runs)[num_runs - 1].num_blocks += 64;
+				block += 63;
+				continue;
+			}
+		}
+
+		value = (block < img->FAT->num_entries)? fatEntryValue(img, block) : BLOCK_RESERVED;
+
+		// a free run ends at the first block in use
+		if(value == BLOCK_AVAILABLE)
+			free_length++;
+		else if(free_length > 0)
+		{
+			bucket = 32 - __builtin_clz(free_length);
+			report->free_runs++;
+			report->histogram_runs[bucket]++;
+			report->histogram_blocks[bucket] += free_length;
+			if(free_length > report->largest_free_run)
+			{
+				report->largest_free_run = free_length;
+				report->largest_free_start = block - free_length;
+			}
+			free_length = 0;
+		}
+
+		// a chain pointing to a block out of any chain is cut there
+		if(value == BLOCK_AVAILABLE || value == BLOCK_RESERVED)
+		{
+			if(in_run)
+				(*next)[num_runs - 1] = block;
+			in_run = false;
+			continue;
+		}
+
+		if(!in_run)
+		{
+			if(num_runs == capacity)
+			{
+				capacity *= 2;
+				*runs = (struct extent*)realloc(*runs, sizeof(struct extent) * capacity);
+				*next = (uint32_t*)realloc(*next, sizeof(uint32_t) * capacity);
+			}
+			(*runs)[num_runs].start_block = block;
+			(*runs)[num_runs].num_blocks = 0;
+			num_runs++;
+		}
+		(*runs)[num_runs - 1].num_blocks++;
+
+		in_run = (value == block + 1);
+		if(!in_run)
+			(*next)[num_runs - 1] = value;
+	}
+
+	return num_runs;
+}
+
+/*
+* Count the extents of the chain of "blocks" blocks from "block" using the
+*	runs of scanFATRuns, one binary search per extent
+*/
+uint32_t countChainExtents(struct extent* runs, uint32_t* next, uint32_t num_runs,
+	uint32_t block, uint32_t blocks)
+{
+	uint32_t count = 0;
+	uint32_t length;
+	uint32_t low, high, mid;
+
+	while(blocks > 0)
+	{
+		// find the last run starting at or before the block
+		low = 0;
+		high = num_runs;
+		while(low < high)
+		{
+			mid = low + (high - low) / 2;
+			if(runs[mid].start_block <= block)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		// the chain is broken
+		if(low == 0 || block >= runs[low-1].start_block + runs[low-1].num_blocks)
+			break;
+
+		count++;
+		length = runs[low-1].start_block + runs[low-1].num_blocks - block;
+		if(length >= blocks)
+			break;
+		blocks -= length;
+		block = next[low-1];
+	}
+	return count;
+}
+
+/*
+* Measure the fragmentation of the files and of the free space into
+*	"report". When "per_file" is set, every file's extents are printed too
+*/
+void measureFragmentation(struct disk_image* img, struct fragReport* report, int per_file)
+{
+	struct extent* runs;
+	struct dirEntry* entry;
+	uint32_t* next;
+	uint32_t num_runs;
+	uint32_t blocks;
+	uint32_t extents;
+	int i;
+
+	num_runs = scanFATRuns(img, &runs, &next, report);
+
+	if(per_file)
+		printf("\nFile extents:\n%10s %12s %30s\n", "Extents", "Avg blocks", "Filename");
+
+	for(i=0; i < img->FDT->num_entries; i++)
+	{
+		entry = rootEntry(img, i);
+		if(!dirEntryIsUsed(entry->status) || !dirEntryIsFile(entry->status))
+			continue;
+
+		blocks = blocksForBytes(img, be32toh(entry->file_size));
+		extents = countChainExtents(runs, next, num_runs, be32toh(entry->start_block), blocks);
+
+		report->files++;
+		report->file_blocks += blocks;
+		report->file_extents += extents;
+		if(extents > 1)
+			report->fragmented_files++;
+
+		if(per_file)
+			printf("%10u %12.1f %30.*s\n", extents, extents? (double)blocks / extents : 0.0,
+				DIR_ENTRY_FILE_NAME_SIZE, entry->filename);
+	}
+
+	free(runs);
+	free(next);
+}
+
+/*
+* Print the summary of a fragmentation report
+*/
+void printFragmentation(struct fragReport* report)
+{
+	printf("Files: %u\n", report->files);
+	printf("Fragmented files: %u\n", report->fragmented_files);
+	printf("File extents: %llu\n", (unsigned long long)report->file_extents);
+	printf("Average extent length: %.1f blocks\n",
+		report->file_extents? (double)report->file_blocks / report->file_extents : 0.0);
+	printf("Free runs: %u\n", report->free_runs);
+	printf("Largest free run: %u blocks at block %u\n",
+		report->largest_free_run, report->largest_free_start);
+}
+
+/*
+*	Write the iovecs in full with as few writev calls as possible. -1 on error
+*/
+int writevFull(struct diskStats* stats, int fd, struct iovec* iov, int iovcnt)
+{
+	ssize_t n;
+
+	while(iovcnt > 0)
+	{
+		STAT_ADD(stats, COUNT_SYSCALLS, 1);
+		n = writev(fd, iov, (iovcnt > IOV_MAX)? IOV_MAX : iovcnt);
+		if(n <= 0)
+			return -1;
+
+		// skip what was written
+		while(iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0)
+		{
+			iov->iov_base = (unsigned char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+*	Write the iovecs in full at "offset", with as few pwritev calls as
+*	possible. -1 on error
+*/
+int pwritevFull(struct diskStats* stats, int fd, struct iovec* iov, int iovcnt, off_t offset)
+{
+	ssize_t n;
+
+	while(iovcnt > 0)
+	{
+		STAT_ADD(stats, COUNT_SYSCALLS, 1);
+		n = pwritev(fd, iov, (iovcnt > IOV_MAX)? IOV_MAX : iovcnt, offset);
+		if(n <= 0)
+			return -1;
+		offset += n;
+
+		// skip what was written
+		while(iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0)
+		{
+			iov->iov_base = (unsigned char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+*	Copy "len" bytes at "offset" of the image into the output file inside
+*	the kernel. Returns 0 on success, -1 if the kernel can not do the copy
+*	(the caller then falls back to writing from the map)
+*/
+int copyRange(struct diskStats* stats, int image_fd, off_t offset, int out_fd, size_t len)
+{
+	loff_t in_offset = offset;
+	ssize_t n;
+
+	while(len > 0)
+	{
+		STAT_ADD(stats, COUNT_SYSCALLS, 1);
+		n = copy_file_range(image_fd, &in_offset, out_fd, NULL, len, 0);
+		if(n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+* Copy the file specified from the file system to the current directory.
+*	The file's chain is resolved into extents first; each extent is then
+*	copied by the kernel from the image when the output is a regular file,
+*	otherwise it is written straight from the map
+*/
+int disk_get(struct disk_image* img, char* filename, char* outFileName)
+{
+    struct dirEntry* fileEntry = NULL; 
+    struct extent* extents = NULL;
+    struct iovec* iov = NULL;
+    struct stat outStats;
+    uint32_t fileSize;
+    uint32_t remaining;
+    size_t length;
+    int numExtents;
+    int copied = 0;
+    int wfp;
+    int i;
+    uint64_t start;
+
+	if((fileEntry = findEntryInFDT(img, filename)) == NULL || !dirEntryIsFile(fileEntry->status))
+	{
+		printf("File not found\n");
+		return -1;
+	}
+
+    // determine the file size
+    fileSize  = be32toh(fileEntry->file_size);
+
+    // determine the runs of blocks to read
+    if((numExtents = resolveExtents(img, be32toh(fileEntry->start_block), fileSize, &extents)) < 0)
+    {
+        printf("error: the FAT chain of %s is broken\n", filename);
+        return -1;
+    }
+
+    // open the file to write to
+    STAT_ADD(img->stats, COUNT_SYSCALLS, 1);
+    wfp = open(outFileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (wfp < 0)
+    {
+        printf("open() error, could not open %s\n", outFileName);
+        free(extents);
+        return -1;
+    }
+
+    start = PHASE_START(img->stats);
+    STAT_ADD(img->stats, COUNT_SYSCALLS, 1);
+
+    // let the kernel copy the extents when writing to a regular file
+    if(fstat(wfp, &outStats) == 0 && S_ISREG(outStats.st_mode))
+    {
+        copied = 1;
+        remaining = fileSize;
+        for(i=0; i < numExtents && copied; i++)
+        {
+            length = (size_t)extents[i].num_blocks << img->fileSystem->block_shift;
+            if(length > remaining) length = remaining;
+
+            if(copyRange(img->stats, img->fd, blockOffset(img, extents[i].start_block), wfp, length) < 0)
+            {
+                // start over from the map
+                copied = 0;
+                STAT_ADD(img->stats, COUNT_SYSCALLS, 2);
+                ftruncate(wfp, 0);
+                lseek(wfp, 0, SEEK_SET);
+            }
+            remaining -= length;
+        }
+    }
+
+    // otherwise gather the extents straight from the map
+    if(!copied)
+    {
+        iov = (struct iovec*)malloc(sizeof(struct iovec) * (numExtents + 1));
+        remaining = fileSize;
+        for(i=0; i < numExtents; i++)
+        {
+            length = (size_t)extents[i].num_blocks << img->fileSystem->block_shift;
+            if(length > remaining) length = remaining;
+
+            iov[i].iov_base = &img->map[blockOffset(img, extents[i].start_block)];
+            iov[i].iov_len = length;
+            remaining -= length;
+        }
+
+        if(writevFull(img->stats, wfp, iov, numExtents) < 0)
+        {
+            printf("error: could not write %s\n", outFileName);
+            free(iov);
+            free(extents);
+            close(wfp);
+            PHASE_STOP(img->stats, PHASE_COPY_OUT, start);
+            return -1;
+        }
+        free(iov);
+    }
+    STAT_ADD(img->stats, COUNT_BYTES_COPIED, fileSize);
+
+    // close and free the file
+    free(extents);
+    STAT_ADD(img->stats, COUNT_SYSCALLS, 1);
+    close(wfp);
+    PHASE_STOP(img->stats, PHASE_COPY_OUT, start);
+    wfp = -1;
+    
+    return 0;
+}
+/*
+* Returns the extent index of the file of entry "position" of "dir",
+*	resolving its chain the first time. Threads reading the same file may
+*	both resolve it, one index is kept. Returns NULL if the chain is broken
+*	or leaves the image
+*/
+struct extentIndex* fileExtentIndex(struct disk_image* img, struct FDT* dir, int position)
+{
+	struct dirEntry* entry = dirEntryAt(img, dir, position);
+	struct extentIndex* index;
+	struct extentIndex* cur = NULL;
+	uint64_t offset = 0;
+	int i;
+
+	if((index = __atomic_load_n(&dir->extent_cache[position], __ATOMIC_ACQUIRE)) != NULL)
+		return index;
+
+	index = (struct extentIndex*)calloc(1, sizeof(struct extentIndex));
+	if((index->count = resolveExtents(img, be32toh(entry->start_block), be32toh(entry->file_size), &index->extents)) < 0)
+	{
+		free(index);
+		return NULL;
+	}
+	index->offsets = (uint64_t*)malloc(sizeof(uint64_t) * (index->count + 1));
+	for(i=0; i < index->count; i++)
+	{
+		index->offsets[i] = offset;
+		offset += (uint64_t)index->extents[i].num_blocks << img->fileSystem->block_shift;
+		if(blockOffset(img, (uint64_t)index->extents[i].start_block + index->extents[i].num_blocks) > (off_t)img->map_size)
+		{
+			freeExtentIndex(index);
+			return NULL;
+		}
+	}
+
+	if(!__atomic_compare_exchange_n(&dir->extent_cache[position], &cur, index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		freeExtentIndex(index);
+		index = cur;
+	}
+	return index;
+}
+
+/*
+* Find the file "filename" for a read of "len" bytes at "offset". Its
+*	extent index and the extent holding the offset are stored in "index"
+*	and "first", and "len" is cut at the end of the file. Returns 1 if
+*	there are bytes to read, 0 at or past the end of the file, -1 on error
+*/
+int locateFileRange(struct disk_image* img, char* filename, uint64_t offset, uint64_t* len,
+	struct extentIndex** index, int* first)
+{
+	struct dirEntry* fileEntry;
+	struct FDT* dir;
+	uint64_t fileSize;
+	int position;
+	int low, high, mid;
+	uint64_t start;
+
+	if((fileEntry = findEntryInPath(img, filename, &dir, &position)) == NULL || !dirEntryIsFile(fileEntry->status))
+	{
+		printf("File not found\n");
+		return -1;
+	}
+
+	fileSize = be32toh(fileEntry->file_size);
+	if(offset >= fileSize)
+		return 0;
+	if(*len > fileSize - offset)
+		*len = fileSize - offset;
+
+	start = PHASE_START(img->stats);
+	*index = fileExtentIndex(img, dir, position);
+	PHASE_STOP(img->stats, PHASE_CHAIN_WALK, start);
+	if(*index == NULL)
+	{
+		printf("error: the FAT chain of %s is broken\n", filename);
+		return -1;
+	}
+
+	// the last extent starting at or before the offset
+	low = 0;
+	high = (*index)->count - 1;
+	while(low < high)
+	{
+		mid = (low + high + 1) / 2;
+		if((*index)->offsets[mid] <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	*first = low;
+	return 1;
+}
+
+/*
+* Copy at most "len" bytes of the file "filename" from byte "offset" into
+*	"buffer", straight from the map. The extents of the file are resolved
+*	by its first read and kept, so a read at any offset costs a binary
+*	search over them rather than a walk of the chain. Reads may run from
+*	many threads, not during a disk_put or disk_remove. Returns the number
+*	of bytes copied, 0 at or past the end of the file, -1 on error
+*/
+ssize_t disk_pread(struct disk_image* img, char* filename, void* buffer, size_t len, uint64_t offset)
+{
+	struct extentIndex* index;
+	uint64_t remaining = len;
+	uint64_t within;
+	size_t copied = 0;
+	size_t length;
+	int found;
+	int i;
+	uint64_t start;
+
+	if((found = locateFileRange(img, filename, offset, &remaining, &index, &i)) <= 0)
+		return found;
+
+	start = PHASE_START(img->stats);
+	for(; copied < remaining; i++)
+	{
+		within = offset + copied - index->offsets[i];
+		length = ((uint64_t)index->extents[i].num_blocks << img->fileSystem->block_shift) - within;
+		if(length > remaining - copied)
+			length = remaining - copied;
+		memcpy((unsigned char*)buffer + copied,
+			&img->map[blockOffset(img, index->extents[i].start_block) + within], length);
+		copied += length;
+	}
+	STAT_ADD(img->stats, COUNT_BYTES_COPIED, copied);
+	PHASE_STOP(img->stats, PHASE_COPY_OUT, start);
+	return copied;
+}
+
+/*
+* Store in "ranges" the runs of bytes of the disk image holding at most
+*	"len" bytes of the file "filename" from byte "offset", for a caller
+*	that sends them from the image itself, e.g. with sendfile on disk_fd.
+*	The ranges are allocated. Returns their number, 0 at or past the end
+*	of the file, -1 on error
+*/
+int disk_map_range(struct disk_image* img, char* filename, uint64_t offset, uint64_t len, struct disk_range** ranges)
+{
+	struct extentIndex* index;
+	uint64_t mapped = 0;
+	uint64_t within;
+	uint64_t length;
+	int count = 0;
+	int found;
+	int i;
+
+	*ranges = NULL;
+	if((found = locateFileRange(img, filename, offset, &len, &index, &i)) <= 0)
+		return found;
+
+	*ranges = (struct disk_range*)malloc(sizeof(struct disk_range) * (index->count - i));
+	for(; mapped < len; i++)
+	{
+		within = offset + mapped - index->offsets[i];
+		length = ((uint64_t)index->extents[i].num_blocks << img->fileSystem->block_shift) - within;
+		if(length > len - mapped)
+			length = len - mapped;
+		(*ranges)[count].offset = blockOffset(img, index->extents[i].start_block) + within;
+		(*ranges)[count].length = length;
+		count++;
+		mapped += length;
+	}
+	return count;
+}
+
+/*
+* Returns the file descriptor of the disk image, for disk_map_range
+*/
+int disk_fd(struct disk_image* img)
+{
+	return img->fd;
+}
+
+/*
+* Copy file from current directory to file system.
+*	The data is staged into large contiguous writes while the FAT links and
+*	the directory entry are made in memory only; disk_sync (or
+*	disk_close) writes them back, so a batch of puts updates the metadata once.
+*	The file keeps its relative path: the directories of "inFileName" are
+*	created in the image as needed. With DISK_OVERWRITE in "flags" a file
+*	of the same name is replaced, reusing its blocks in place; without it
+*	a name already in the directory is refused. A replacement that fails
+*	leaves the old entry and chain whole, but the blocks written before
+*	the failure hold the new data
+*/
+
+int disk_put(struct disk_image* img, char *inFileName, int flags)
+{
+    struct dirEntry* rootEntry = NULL;
+    struct dirEntry* oldEntry = NULL;
+    struct FDT* dir = NULL;
+    unsigned char* stage = NULL;
+    struct stat infileStats;
+    char name[DIR_ENTRY_FILE_NAME_SIZE];
+    char* path;
+    int pathLength;
+    int split;
+    int position;
+    int rfp;
+    int currentBlock = -1;
+    int blocksRequired = 0;
+    int blocksAllocated = 0;
+    uint32_t runLength = 0;
+    uint32_t chunkBlocks;
+    uint32_t stageBlocks = STAGE_BYTES >> img->fileSystem->block_shift;
+    uint32_t nextBlock;
+    off_t chunkOffset;
+    size_t chunkBytes;
+    size_t staged = 0;
+    size_t used = 0;
+    bool direct = false;
+    bool replaced = false;
+    ssize_t bytesRead;
+    struct extent* extents = NULL;
+    int numExtents = 0;
+    struct extent* oldExtents = NULL;
+    int numOldExtents = 0;
+    int reusedExtents;
+    uint32_t skip;
+    int i;
+    uint32_t j;
+    uint64_t start;
+
+    if (inFileName == NULL)
+    {
+        printf("error: null input file\n");
+        return -1;
+    }
+
+    if (!img->writable)
+    {
+        printf("error: %s is open read only\n", img->path);
+        return -1;
+    }
+
+    // open the input file
+    STAT_ADD(img->stats, COUNT_SYSCALLS, 2);
+    if((rfp = open(inFileName, O_RDONLY)) < 0)
+    {
+        printf("File not found\n");
+        return -1;
+    }
+
+    if((fstat(rfp, &infileStats)) == -1)
+	{
+		perror("fstat()\n");
+		close(rfp);
+		return -1;
+	}	
+
+    // find the directory of the file, creating the missing ones
+    path = (char*)malloc(strlen(inFileName) + 1);
+    if ((pathLength = normalizePath(inFileName, path)) <= 0)
+    {
+        printf("error: invalid file name %s, it has a \"..\" or a name longer than %d characters\n",
+            inFileName, DIR_ENTRY_FILE_NAME_SIZE - 1);
+        free(path);
+        close(rfp);
+        return -1;
+    }
+    for (split = pathLength - 1; split >= 0 && path[split] != '/'; split--)
+        ;
+    memset(name, 0, sizeof(name));
+    memcpy(name, &path[split + 1], pathLength - split - 1);
+    dir = lookupDirectory(img, path, (split > 0)? split : 0, true);
+    free(path);
+    if (dir == NULL || checkDirWritable(img, dir) < 0)
+    {
+        close(rfp);
+        return -1;
+    }
+
+    // a name may be taken only by a file being replaced, which keeps its entry
+    position = -1;
+    oldEntry = findEntryInDir(img, dir, name, strlen(name), &position);
+    if (oldEntry != NULL && !dirEntryIsFile(oldEntry->status))
+    {
+        printf("ERROR: Could not add file <%s>, it is a directory\n", inFileName);
+        close(rfp);
+        return -1;
+    }
+    if (oldEntry != NULL && !(flags & DISK_OVERWRITE))
+    {
+        printf("ERROR: Could not add file <%s>, file exists, use -o\n", inFileName);
+        close(rfp);
+        return -1;
+    }
+    if (oldEntry != NULL &&
+        (numOldExtents = resolveExtents(img, be32toh(oldEntry->start_block), be32toh(oldEntry->file_size), &oldExtents)) < 0)
+    {
+        printf("error: the FAT chain of %s is broken\n", inFileName);
+        close(rfp);
+        return -1;
+    }
+
+    // determine number of blocks required for the infile
+    blocksRequired = blocksForBytes(img, infileStats.st_size);
+
+    // the blocks of the file being replaced are reused first, in their order
+    extents = (struct extent*)malloc(sizeof(struct extent) * (blocksRequired + numOldExtents + 1));
+    blocksAllocated = 0;
+    for (i=0; i < numOldExtents && blocksAllocated < blocksRequired; i++)
+    {
+        extents[numExtents] = oldExtents[i];
+        if (extents[numExtents].num_blocks > (uint32_t)(blocksRequired - blocksAllocated))
+            extents[numExtents].num_blocks = blocksRequired - blocksAllocated;
+        blocksAllocated += extents[numExtents].num_blocks;
+        numExtents++;
+    }
+    reusedExtents = numExtents;
+
+    // reserve every other block of the file up front as a list of contiguous runs
+    while (blocksAllocated < blocksRequired)
+    {
+        currentBlock = allocFATRun(img, blocksRequired - blocksAllocated, &runLength);
+        if (currentBlock == -1)
+            break;
+        extents[numExtents].start_block = currentBlock;
+        extents[numExtents].num_blocks = runLength;
+        numExtents++;
+        blocksAllocated += runLength;
+    }
+    // make sure there is room for the file's data
+    if (blocksAllocated < blocksRequired)
+    {
+        printf("ERROR: Could not add file <%s>, not enough free blocks\n", inFileName);
+        goto fail;
+    }
+
+    // read the input a stage at a time and write each run's slice of it,
+    // so that runs of single blocks cost no read each. A run of a whole
+    // stage is read straight into the map when it is writable
+    stage = (unsigned char*)malloc(STAGE_BYTES);
+    for (i=0; i < numExtents; i++)
+    {
+        for (j=0; j < extents[i].num_blocks; j += chunkBlocks)
+        {
+            chunkBlocks = extents[i].num_blocks - j;
+            chunkOffset = blockOffset(img, extents[i].start_block + j);
+
+            if (used == staged)
+            {
+                // read the next stage of the input file, the last one may be short
+                direct = (img->mapped_writes && chunkBlocks >= stageBlocks);
+                start = PHASE_START(img->stats);
+                bytesRead = readFull(img->stats, rfp, direct? &img->map[chunkOffset] : stage, STAGE_BYTES);
+                PHASE_STOP(img->stats, PHASE_READ_INPUT, start);
+                if (bytesRead < 0)
+                {
+                    printf("error: could not read %s\n", inFileName);
+                    goto fail;
+                }
+                STAT_ADD(img->stats, COUNT_BYTES_READ, bytesRead);
+                used = 0;
+                staged = direct? 0 : (size_t)bytesRead;
+                if (direct)
+                {
+                    chunkBlocks = stageBlocks;
+                    chunkBytes = bytesRead;
+                }
+            }
+            if (!direct)
+            {
+                // the input ran short, the rest of the blocks are left as they are
+                if (used == staged)
+                    continue;
+                if (chunkBlocks > blocksForBytes(img, staged - used))
+                    chunkBlocks = blocksForBytes(img, staged - used);
+                chunkBytes = (size_t)chunkBlocks << img->fileSystem->block_shift;
+                if (chunkBytes > staged - used)
+                    chunkBytes = staged - used;
+            }
+
+            // write the slice to its run in the diskimage
+            replaced |= (i < reusedExtents);
+            if (img->mapped_writes)
+            {
+                // the slice is synced by disk_sync
+                if (!direct)
+                    memcpy(&img->map[chunkOffset], &stage[used], chunkBytes);
+                if (img->dirty_end == img->dirty_start || chunkOffset < img->dirty_start)
+                    img->dirty_start = chunkOffset;
+                if (chunkOffset + (off_t)chunkBytes > img->dirty_end)
+                    img->dirty_end = chunkOffset + chunkBytes;
+            }
+            else
+            {
+                start = PHASE_START(img->stats);
+                if (pwriteFull(img->stats, img->fd, &stage[used], chunkBytes, chunkOffset) < 0)
+                {
+                    printf("error: could not write %s to %s\n", inFileName, img->path);
+                    goto fail;
+                }
+                PHASE_STOP(img->stats, PHASE_WRITE_DATA, start);
+            }
+            STAT_ADD(img->stats, COUNT_BYTES_WRITTEN, chunkBytes);
+            if (!direct)
+                used += chunkBytes;
+            direct = false;
+        }
+    }
+    free(stage);
+    stage = NULL;
+
+    // a full directory grows by a block, last so that a failed put leaves
+    // it as it was
+    buildFDTIndex(img, dir);
+    if (position == -1 && dir->num_free == 0 && growDirectory(img, dir) < 0)
+    {
+        printf("ERROR: Could not add file <%s>, filesystem is full\n", inFileName);
+        goto fail;
+    }
+
+    // link every block of the file in the in-memory FAT, once all of its
+    // data is written: a failed put leaves no chain behind
+    start = PHASE_START(img->stats);
+    for (i=0; i < numExtents; i++)
+    {
+        for (j=0; j < extents[i].num_blocks; j++)
+        {
+            if (j + 1 < extents[i].num_blocks)
+                nextBlock = extents[i].start_block + j + 1;
+            else if (i + 1 < numExtents)
+                nextBlock = extents[i+1].start_block;
+            else
+                nextBlock = BLOCK_END;
+
+            setFATEntry(img, extents[i].start_block + j, nextBlock);
+        }
+    }
+    PHASE_STOP(img->stats, PHASE_DIR_UPDATE, start);
+
+    // the blocks of a replaced file past the end of the new one are freed
+    skip = blocksRequired;
+    for (i=0; i < numOldExtents; i++)
+    {
+        if (skip >= oldExtents[i].num_blocks)
+        {
+            skip -= oldExtents[i].num_blocks;
+            continue;
+        }
+        freeFATRun(img, oldExtents[i].start_block + skip, oldExtents[i].num_blocks - skip);
+        skip = 0;
+    }
+    free(oldExtents);
+
+    // fill in the directory entry; times are left zeroed
+    start = PHASE_START(img->stats);
+    // the entry is written by disk_sync, after the FAT that links its data
+    if (oldEntry == NULL)
+        position = popFreeDirEntry(dir);
+    rootEntry = writableDirEntry(img, dir, position);
+    memset(rootEntry, 0, sizeof(struct dirEntry));
+    rootEntry->status = (DIR_ENTRY_USED | DIR_ENTRY_FILE);
+    // an empty file owns no blocks
+    rootEntry->start_block = htobe32((numExtents > 0)? extents[0].start_block : BLOCK_END);
+    rootEntry->num_blocks = htobe32(blocksRequired);
+    rootEntry->file_size = htobe32(infileStats.st_size);
+    memcpy(rootEntry->filename, name, DIR_ENTRY_FILE_NAME_SIZE);
+    memset(rootEntry->unused, 0xFF, DIR_ENTRY_UNUSED_SIZE);
+    if (oldEntry == NULL)
+        indexDirEntry(img, dir, position);
+    PHASE_STOP(img->stats, PHASE_DIR_UPDATE, start);
+
+    free(extents);
+    STAT_ADD(img->stats, COUNT_SYSCALLS, 1);
+    close(rfp);
+
+    // make the file durable on its own
+    if (img->mapped_writes && img->msync_mode == MSYNC_FILE)
+        return disk_sync(img);
+    return 0;
+
+fail:
+    // the runs reserved for the file are given back, nothing links them yet.
+    // A replaced file keeps its entry and chain, not all of its old data
+    for (i=reusedExtents; i < numExtents; i++)
+        releaseFATRun(img, extents[i].start_block, extents[i].num_blocks);
+    if (replaced)
+        printf("warning: %s keeps its old size, but some of its blocks already hold the new data\n", inFileName);
+    free(stage);
+    free(extents);
+    free(oldExtents);
+    close(rfp);
+    return -1;
+}
+
+/*
+* Remove the file at "path": its FAT chain is freed one run at a time and
+*	its entry cleared, for the next file put in its directory. Like
+*	disk_put the changes are written back by disk_sync. Returns 0 on
+*	success, -1 on error
+*/
+int disk_remove(struct disk_image* img, char* path)
+{
+	struct dirEntry* entry;
+	struct extent* extents;
+	struct FDT* dir;
+	int position;
+	int count;
+	int i;
+
+	if(!img->writable)
+	{
+		printf("error: %s is open read only\n", img->path);
+		return -1;
+	}
+
+	if((entry = findEntryInPath(img, path, &dir, &position)) == NULL)
+	{
+		printf("File not found\n");
+		return -1;
+	}
+	if(!dirEntryIsFile(entry->status))
+	{
+		printf("error: %s is a directory\n", path);
+		return -1;
+	}
+	if(checkDirWritable(img, dir) < 0)
+		return -1;
+	if((count = resolveExtents(img, be32toh(entry->start_block), be32toh(entry->file_size), &extents)) < 0)
+	{
+		printf("error: the FAT chain of %s is broken\n", path);
+		return -1;
+	}
+
+	for(i=0; i < count; i++)
+		freeFATRun(img, extents[i].start_block, extents[i].num_blocks);
+	free(extents);
+
+	// the name leaves the index while the entry still holds it
+	unindexDirEntry(img, dir, position);
+	memset(writableDirEntry(img, dir, position), 0, sizeof(struct dirEntry));
+	pushFreeDirEntry(dir, position);
+	return 0;
+}
+
+/*
+* Create a new disk image of "num_blocks" blocks of "block_size" bytes with
+*	an empty root directory of "root_blocks" blocks. Block 0 holds the
+*	superblock, the FAT follows it, then the root directory. The FAT marks
+*	block 0 and its own blocks reserved and chains the root directory's
+*	blocks like a file. The image is created sparse, unless DISK_PREALLOCATE
+*	asks for its space to be allocated. Returns 0 on success, -1 on error
+*/
+int disk_format(const char* path, uint32_t block_size, uint32_t num_blocks,
+	uint32_t root_blocks, int flags)
+{
+	unsigned char* buffer;
+	uint32_t fat_blocks;
+	uint32_t used_blocks;		// superblock, FAT and root directory blocks
+	uint32_t fat_bytes;
+	uint32_t value;
+	uint32_t i;
+	uint16_t auxShort;
+	off_t size;
+	int offset;
+	int fd;
+
+	if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+	{
+		printf("error: the block size must be a power of 2 from %d to %d\n",
+			MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+		return -1;
+	}
+
+	// the FAT has an entry for every block
+	fat_blocks = ((uint64_t)num_blocks*FAT_ENTRY_SIZE + block_size - 1) / block_size;
+	used_blocks = 1 + fat_blocks + root_blocks;
+	if(root_blocks == 0 || num_blocks > INT_MAX || num_blocks <= used_blocks)
+	{
+		printf("error: %u blocks can not hold a file system with %u root directory blocks\n",
+			num_blocks, root_blocks);
+		return -1;
+	}
+	size = (off_t)num_blocks * block_size;
+
+	if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+	{
+		printf("error: could not create %s\n", path);
+		return -1;
+	}
+
+	// size the image: unwritten blocks read back as zeros, which is an
+	// empty FAT entry and an unused directory entry
+	if(ftruncate(fd, size) < 0 ||
+		((flags & DISK_PREALLOCATE) && fallocate(fd, 0, 0, size) < 0))
+	{
+		printf("error: could not allocate %lld bytes for %s\n", (long long)size, path);
+		close(fd);
+		return -1;
+	}
+
+	// only the FAT blocks holding non zero entries need to be written
+	fat_bytes = ((used_blocks*FAT_ENTRY_SIZE + block_size - 1) / block_size) * block_size;
+	buffer = (unsigned char*)calloc(1, block_size + fat_bytes);
+
+	// superblock
+	offset = 0;
+	memcpy(&buffer[offset], "CSC360FS", 8);
+	offset += 8;
+	auxShort = htons(block_size);
+	memcpy(&buffer[offset], &auxShort, 2);
+	offset += 2;
+	value = htonl(num_blocks);
+	memcpy(&buffer[offset], &value, 4);
+	offset += 4;
+	value = htonl(1);
+	memcpy(&buffer[offset], &value, 4);
+	offset += 4;
+	value = htonl(fat_blocks);
+	memcpy(&buffer[offset], &value, 4);
+	offset += 4;
+	value = htonl(1 + fat_blocks);
+	memcpy(&buffer[offset], &value, 4);
+	offset += 4;
+	value = htonl(root_blocks);
+	memcpy(&buffer[offset], &value, 4);
+	offset += 4;
+
+	// FAT: reserve the superblock and FAT blocks, chain the root directory
+	for(i=0; i < used_blocks; i++)
+	{
+		if(i <= fat_blocks)
+			value = BLOCK_RESERVED;
+		else if(i + 1 < used_blocks)
+			value = i + 1;
+		else
+			value = BLOCK_END;
+
+		value = htonl(value);
+		memcpy(&buffer[block_size + i*FAT_ENTRY_SIZE], &value, FAT_ENTRY_SIZE);
+	}
+
+	if(pwriteFull(NULL, fd, buffer, block_size + fat_bytes, 0) < 0 || fsync(fd) < 0)
+	{
+		printf("error: could not write %s\n", path);
+		free(buffer);
+		close(fd);
+		return -1;
+	}
+
+	free(buffer);
+	close(fd);
+	return 0;
+}
+
+/*
+* First step of disk_open: replay a journal left by a crash, then open and
+*	map the disk image with the modes of "flags". Nothing is parsed yet;
+*	the benchmark times the next steps one by one. Returns NULL on error
+*/
+struct disk_image* mapImage(const char* path, int flags)
+{
+	struct disk_image* img;
+	struct stat fileStats;	// Statistics of disk image
+
+	img = (struct disk_image*)calloc(1, sizeof(struct disk_image));
+	img->path = strdup(path);
+	img->writable = (flags & DISK_WRITE)? 1 : 0;
+	img->mapped_writes = (img->writable && (flags & DISK_MMAP))? 1 : 0;
+	img->msync_mode = (flags & DISK_MSYNC_NONE)? MSYNC_NONE : (flags & DISK_MSYNC_FILE)? MSYNC_FILE : MSYNC_END;
+	pthread_mutex_init(&img->dirs_lock, NULL);
+	if(flags & DISK_STATS)
+		img->stats = (struct diskStats*)calloc(1, sizeof(struct diskStats));
+
+	// Finish the transaction of a put interrupted by a crash, read only
+	// opens only check that there is none to finish
+	if(replayJournal(path, img->stats, img->writable) < 0)
+	{
+		free(img->path);
+		free(img->stats);
+		free(img);
+		return NULL;
+	}
+
+	// open, fstat and mmap
+	STAT_ADD(img->stats, COUNT_SYSCALLS, 3);
+
+	// Open image file
+	if((img->fd = open(path, img->writable? O_RDWR : O_RDONLY)) == -1)
+	{
+		printf("error: could not open %s\n", path);
+		free(img->path);
+		free(img->stats);
+		free(img);
+		return NULL;
+	}
+
+	// Insert information on the disk image into the stats struct
+	if((fstat(img->fd, &fileStats)) == -1)
+	{
+		perror("fstat()\n");
+		close(img->fd);
+		free(img->path);
+		free(img->stats);
+		free(img);
+		return NULL;
+	}
+	img->map_size = fileStats.st_size;
+
+	// Insert the bytes of the disk image into the map
+	if(img->map_size < SUPERBLOCK_SIZE ||
+		(img->map = mmap((caddr_t)0,
+					img->map_size,
+					 img->mapped_writes? PROT_READ | PROT_WRITE : PROT_READ,
+					 MAP_SHARED,
+					 img->fd,
+					 0)) == MAP_FAILED)
+	{
+		perror("mmap()\n");
+		close(img->fd);
+		free(img->path);
+		free(img->stats);
+		free(img);
+		return NULL;
+	}
+	return img;
+}
+
+/*
+* Open a disk image and parse its metadata once. DISK_WRITE opens the
+*	image for disk_put; with DISK_MMAP too, disk_put stores into a writable
+*	map and the DISK_MSYNC_* flags pick when the stores are synced. With
+*	DISK_JOURNAL each disk_sync is a transaction of "<path>.journal".
+*	A journal left by a crash is replayed first. Returns NULL on error
+*/
+struct disk_image* disk_open(const char* path, int flags)
+{
+	struct disk_image* img;
+	uint64_t start = (flags & DISK_STATS)? statClock() : 0;
+	uint64_t fdt_start;
+
+	if((img = mapImage(path, flags)) == NULL)
+		return NULL;
+
+	// Read the superblock, the FAT and the root directory.
+	// Make sure the block size is supported and that the FAT is inside
+	// the image; read_FDT checks the root directory
+	if(read_superblock(img) < 0 ||
+		blockOffset(img, (uint64_t)img->FAT->start_block + img->FAT->num_blocks) > (off_t)img->map_size)
+	{
+		printf("error: %s is not a valid disk image\n", path);
+		free_FDT(img);
+		free_FAT(img);
+		free_fileSystem(img);
+		munmap(img->map, img->map_size);
+		close(img->fd);
+		free(img->path);
+		free(img->stats);
+		free(img);
+		return NULL;
+	}
+
+	if(img->writable && (flags & DISK_JOURNAL))
+	{
+		img->journal = (struct journal*)calloc(1, sizeof(struct journal));
+		img->journal->path = (char*)malloc(strlen(path) + sizeof(JOURNAL_SUFFIX));
+		sprintf(img->journal->path, "%s%s", path, JOURNAL_SUFFIX);
+		img->journal->fd = -1;
+		img->journal->capacity = 1 << 16;
+		img->journal->buffer = (unsigned char*)malloc(img->journal->capacity);
+	}
+
+	init_FAT(img);
+	fdt_start = PHASE_START(img->stats);
+	if(read_FDT(img) < 0)
+	{
+		printf("error: %s is not a valid disk image\n", path);
+		// nothing is written back
+		img->writable = 0;
+		disk_close(img);
+		return NULL;
+	}
+	PHASE_STOP(img->stats, PHASE_FDT_READ, fdt_start);
+	PHASE_STOP(img->stats, PHASE_OPEN, start);
+
+	return img;
+}
+
+/*
+* Write back the FAT and then the root directory entries changed by disk_put.
+*	The FAT goes first so that no entry is ever written before the chain
+*	of its data. With DISK_MMAP the data stored in the map is synced before
+*	both, unless DISK_MSYNC_NONE leaves the write back to the kernel. With
+*	DISK_JOURNAL both are committed as one transaction.
+*	Returns 0 on success, -1 on error
+*/
+int disk_sync(struct disk_image* img)
+{
+	if(img->dirty_end > img->dirty_start)
+	{
+		if(img->msync_mode != MSYNC_NONE &&
+			syncMapRange(img, img->dirty_start, img->dirty_end - img->dirty_start) < 0)
+		{
+			printf("error: could not write the data of %s\n", img->path);
+			return -1;
+		}
+		img->dirty_start = img->dirty_end = 0;
+	}
+	if(img->journal != NULL)
+		beginJournal(img);
+	if(flush_FAT(img) < 0)
+	{
+		printf("error: could not update the FAT of %s\n", img->path);
+		return -1;
+	}
+	if(flush_FDT(img) < 0)
+	{
+		printf("error: could not update the root directory of %s\n", img->path);
+		return -1;
+	}
+	if(img->journal != NULL && commitJournal(img) < 0)
+	{
+		printf("error: could not commit the metadata of %s\n", img->path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+* Make the data copied by disk_defrag durable, then commit the new chains
+*	and directory entries, and only then free the "count" old chains of the
+*	batch in memory; they are written back with the next commit
+*/
+int commitDefragBatch(struct disk_image* img, struct extent** old_extents, int* old_counts, int count)
+{
+	int i, e;
+
+	STAT_ADD(img->stats, COUNT_SYSCALLS, 2);
+	if(fsync(img->fd) < 0 || disk_sync(img) < 0 || fsync(img->fd) < 0)
+		return -1;
+
+	for(i=0; i < count; i++)
+	{
+		for(e=0; e < old_counts[i]; e++)
+			freeFATRun(img, old_extents[i][e].start_block, old_extents[i][e].num_blocks);
+		free(old_extents[i]);
+	}
+	return 0;
+}
+
+/*
+* Move every file made of more than one extent into one run of free blocks,
+*	filling the image from its start. The move is crash safe: the data is
+*	copied and synced first, then the new chain and the directory entry are
+*	written, and the old chain is freed last. A crash leaves every file on
+*	either its old or its new chain, at worst leaking the blocks of the
+*	other. Files for which no run is large enough stay where they are.
+*	Fragmentation is reported before and after. Returns the number of
+*	files moved, -1 on error
+*/
+int disk_defrag(struct disk_image* img)
+{
+	struct fragReport report;
+	struct extent* old_extents[DEFRAG_BATCH_FILES];
+	int old_counts[DEFRAG_BATCH_FILES];
+	struct extent* extents;
+	struct dirEntry* entry;
+	struct iovec* iov;
+	uint64_t batch_bytes = 0;
+	uint32_t blocks;
+	uint32_t length;
+	uint32_t j;
+	int numExtents;
+	int newStart;
+	int batch = 0;
+	int moved = 0;
+	int skipped = 0;
+	int i, e;
+
+	if(!img->writable)
+	{
+		printf("error: %s is open read only\n", img->path);
+		return -1;
+	}
+
+	// the entries of the root directory are rewritten
+	if(checkDirWritable(img, img->FDT) < 0)
+		return -1;
+
+	measureFragmentation(img, &report, 0);
+	printf("\nBefore:\n");
+	printFragmentation(&report);
+
+	// first fit, so that the files are packed towards the start of the image
+	img->FAT->next_free = 0;
+	img->FAT->no_run_from = UINT32_MAX;
+
+	for(i=0; i < img->FDT->num_entries; i++)
+	{
+		entry = rootEntry(img, i);
+		if(!dirEntryIsUsed(entry->status) || !dirEntryIsFile(entry->status))
+			continue;
+
+		blocks = blocksForBytes(img, be32toh(entry->file_size));
+		if((numExtents = resolveExtents(img, be32toh(entry->start_block), be32toh(entry->file_size), &extents)) < 0)
+		{
+			printf("error: the FAT chain of %.*s is broken\n", DIR_ENTRY_FILE_NAME_SIZE, entry->filename);
+			skipped++;
+			continue;
+		}
+		if(numExtents <= 1)
+		{
+			free(extents);
+			continue;
+		}
 
-    // open the file to write to
-    wfp = open(outFileName, O_RDWR | O_CREAT, S_IRUSR | S_IRGRP | S_IROTH);
+		// a single run holding the whole file
+		if((newStart = allocFATRun(img, blocks, &length)) == -1 || length < blocks)
+		{
+			if(newStart != -1)
+				releaseFATRun(img, newStart, length);
+			free(extents);
+			skipped++;
+			continue;
+		}
 
-    if (wfp < 0)
-    {
-        printf("open() error, could not open %s\n", outFileName);
-        exit(-1);
-    }
+		// copy the extents straight from the map into the run
+		iov = (struct iovec*)malloc(sizeof(struct iovec) * numExtents);
+		for(e=0; e < numExtents; e++)
+		{
+			iov[e].iov_base = &img->map[blockOffset(img, extents[e].start_block)];
+			iov[e].iov_len = (size_t)extents[e].num_blocks << img->fileSystem->block_shift;
+		}
+		if(pwritevFull(img->stats, img->fd, iov, numExtents, blockOffset(img, newStart)) < 0)
+		{
+			printf("error: could not move %.*s\n", DIR_ENTRY_FILE_NAME_SIZE, entry->filename);
+			releaseFATRun(img, newStart, length);
+			free(iov);
+			free(extents);
+			commitDefragBatch(img, old_extents, old_counts, batch);
+			return -1;
+		}
+		free(iov);
+		STAT_ADD(img->stats, COUNT_BYTES_WRITTEN, (uint64_t)blocks << img->fileSystem->block_shift);
 
-    // for each block
-    int i;
-    for (i=0; i < blocks2Read; i++)
-    {
-    	// go to next block
-    	current_index = file_block*BLOCK_SIZE;
+		// chain the run and point the entry at it, in memory until the commit
+		for(j=0; j < blocks; j++)
+			setFATEntry(img, newStart + j, (j + 1 < blocks)? (uint32_t)newStart + j + 1 : BLOCK_END);
+		writableRootEntry(img, i)->start_block = htobe32(newStart);
 
-    	// read the block
-        memcpy(&buffer, &map[current_index], BLOCK_SIZE);
+		old_extents[batch] = extents;
+		old_counts[batch] = numExtents;
+		batch++;
+		batch_bytes += (uint64_t)blocks << img->fileSystem->block_shift;
+		moved++;
 
-        // write the block to outfile
-        write(wfp, buffer, BLOCK_SIZE);
+		if(batch == DEFRAG_BATCH_FILES || batch_bytes >= DEFRAG_BATCH_BYTES)
+		{
+			if(commitDefragBatch(img, old_extents, old_counts, batch) < 0)
+			{
+				printf("error: could not update %s\n", img->path);
+				return -1;
+			}
+			batch = 0;
+			batch_bytes = 0;
+		}
+	}
 
-        //go to next block
-        file_block = FAT->entries[file_block];
-    }
+	// commit the last batch and write back its freed chains
+	if(commitDefragBatch(img, old_extents, old_counts, batch) < 0 || disk_sync(img) < 0)
+	{
+		printf("error: could not update %s\n", img->path);
+		return -1;
+	}
 
-    // if there are still some bytes leftover
-	if (remaining_bytes > 0)
-    {
-        // go to beginning of remaining block
-    	current_index = file_block*BLOCK_SIZE;
+	measureFragmentation(img, &report, 0);
+	printf("\nAfter:\n");
+	printFragmentation(&report);
+	printf("Files moved: %d\n", moved);
+	if(skipped > 0)
+		printf("Files left fragmented: %d\n", skipped);
 
-    	// read the remaining bytes
-        memcpy(&buffer, &map[current_index], remaining_bytes);
+	return moved;
+}
 
-        // write remaining bytes to output file
-        write(wfp, buffer, remaining_bytes);
-    }
+/*
+* Read a list of filenames, one per line, from "path" or from the standard
+*	input when "path" is "-". Blank lines are skipped. Returns the list and
+*	stores its length in "count", NULL if the list can not be read
+*/
+char** read_name_list(const char* path, int* count)
+{
+	FILE* list;
+	char** names = NULL;
+	char* line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	int capacity = 0;
+
+	*count = 0;
+	if(!strcmp(path, "-"))
+		list = stdin;
+	else if((list = fopen(path, "r")) == NULL)
+	{
+		printf("error: could not open %s\n", path);
+		return NULL;
+	}
 
-    // close and free the file
-    close(wfp);
-    wfp = -1;
-    
+	while((length = getline(&line, &line_size, list)) != -1)
+	{
+		// strip the line ending
+		while(length > 0 && (line[length-1] == '\n' || line[length-1] == '\r'))
+			line[--length] = '\0';
+		if(length == 0)
+			continue;
+
+		if(*count == capacity)
+		{
+			capacity = capacity? capacity*2 : 64;
+			names = (char**)realloc(names, sizeof(char*) * capacity);
+		}
+		names[(*count)++] = strdup(line);
+	}
+
+	free(line);
+	if(list != stdin)
+		fclose(list);
+
+	// an empty list is still a list
+	if(names == NULL)
+		names = (char**)malloc(sizeof(char*));
+	return names;
 }
+
 /*
-* Copy file from current directory to file system
+* Record that item "entry" uses "block". When two files use the same
+*	block the one of the lower item keeps it, so that the result does not
+*	depend on the order of the threads; the metadata always keeps its
+*	blocks. Returns the CHECK_* problem of "entry", 0 if none
 */
+int claimBlock(struct checkState* check, int entry, uint32_t block)
+{
+	uint32_t me = entry + 1;
+	uint32_t cur = __atomic_load_n(&check->owner[block], __ATOMIC_RELAXED);
+
+	while(1)
+	{
+		if(cur == 0)
+		{
+			if(__atomic_compare_exchange_n(&check->owner[block], &cur, me, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return 0;
+		}
+		else if(cur == me)
+		{
+			return CHECK_CYCLE;
+		}
+		else if(cur != OWNER_METADATA && me < cur)
+		{
+			if(__atomic_compare_exchange_n(&check->owner[block], &cur, me, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				__atomic_or_fetch(&check->problems[cur - 1], CHECK_CROSSLINK, __ATOMIC_RELAXED);
+				return 0;
+			}
+		}
+		else
+		{
+			return CHECK_CROSSLINK;
+		}
+	}
+}
 
-void put_file(char* imageFileName, char *inFileName)
+/*
+* Walk the FAT chain of item "entry" as far as its size, recording
+*	the blocks it uses and its problems. A directory is checked as the
+*	file of its blocks
+*/
+void checkFileChain(struct checkState* check, int entry)
 {
-    unsigned char buffer[BLOCK_SIZE];
-    int rootEntryPosition = -1;
-    //struct tm timeInfo;
-    struct stat infileStats;
-    struct stat diskimageStats;
-    //time_t now;
-    int fp;
-    int fpPosition;
-    int rfp;
-    int currentBlock = -1;
-    int previousBlock = -1;
-    int blocksRequired = 0;
-    int totalBytesRead = 0;
-    int bytesRead = 0;
-    int auxShort = 0;
-    int auxInt = 0;
-    int auxWriteOffset = 0;
-    int writeOffset = 0;
-    int i;
+	struct disk_image* img = check->img;
+	struct dirEntry* dir = dirEntryAt(img, check->items[entry].dir, check->items[entry].entry);
+	uint32_t blocks = blocksForBytes(img, be32toh(dir->file_size));
+	uint32_t block = be32toh(dir->start_block);
+	uint32_t length;
+	uint32_t next;
+	uint32_t i, j;
+	int problems = 0;
+
+	if(be32toh(dir->num_blocks) != blocks)
+		problems |= CHECK_NUM_BLOCKS;
+
+	for(i=0; i < blocks; i += length)
+	{
+		if(block >= img->FAT->num_entries)
+		{
+			problems |= (i == 0)? CHECK_BAD_START : CHECK_BROKEN;
+			break;
+		}
 
-    //printf("opening infile and diskimage...\n");
-    if (imageFileName == NULL)
-    {
-        printf("error: null disk image\n");
-        exit(-1);
-    }
+		// every block of the run is recorded, the run counts as one hop
+		length = chainRunLength(img, block, blocks - i);
+		for(j=0; j < length && !(problems & CHECK_CYCLE); j++)
+			problems |= claimBlock(check, entry, block + j);
+		if(problems & CHECK_CYCLE)
+			break;
 
-    if (inFileName == NULL)
-    {
-        printf("error: null input file\n");
-        exit(-1);
-    }
+		next = getFATEntry(img, block + length - 1);
+		if(i + length == blocks)
+		{
+			// the last block must end the chain
+			check->last_block[entry] = block + length - 1;
+			if(next != BLOCK_END)
+				problems |= CHECK_LONG;
+		}
+		else if(next == BLOCK_END)
+		{
+			problems |= CHECK_SHORT;
+			break;
+		}
+		else if(next < BLOCK_MIN_ALLOCATED || next > BLOCK_MAX_ALLOCATED)
+		{
+			problems |= CHECK_BROKEN;
+			break;
+		}
+		block = next;
+	}
 
-    if (access(inFileName, R_OK))
-    {
-        printf("File not found\n");
-        exit(-1);
-    }
+	STAT_ADD(img->stats, COUNT_CHAIN_HOPS, i);
+	__atomic_or_fetch(&check->problems[entry], problems, __ATOMIC_RELAXED);
+}
 
+/*
+* Check the chains of the items of the current tree level until none is left
+*/
+void* checkWorker(void* arg)
+{
+	struct checkState* check = (struct checkState*)arg;
+	int i;
 
-    // open the disk image file
-    if((fp = open(imageFileName, O_RDWR)) < 0)
-    {
-        printf("error: could not open %s\n", imageFileName);
-        exit(-1);
-    }
+	while((i = __atomic_fetch_add(&check->next_entry, 1, __ATOMIC_RELAXED)) < check->level_end)
+		checkFileChain(check, i);
+	return NULL;
+}
 
-    // get diskimage stats
-    if((fstat(fp, &diskimageStats)) == 1)
+/*
+* Add the files and directories of "dir" to the items to be checked
+*/
+void addCheckItems(struct checkState* check, struct FDT* dir)
+{
+	struct dirEntry* entry;
+	int i;
+
+	for(i=0; i < dir->num_entries; i++)
 	{
-		perror("fstat()\n");
-		exit(-1);
+		entry = dirEntryAt(check->img, dir, i);
+		if(!dirEntryIsUsed(entry->status) ||
+			!(dirEntryIsFile(entry->status) || dirEntryIsDirectory(entry->status)))
+		{
+			continue;
+		}
+
+		if(check->num_items % 64 == 0)
+		{
+			check->items = (struct checkItem*)realloc(check->items, sizeof(struct checkItem) * (check->num_items + 64));
+			check->problems = (uint8_t*)realloc(check->problems, sizeof(uint8_t) * (check->num_items + 64));
+			check->last_block = (uint32_t*)realloc(check->last_block, sizeof(uint32_t) * (check->num_items + 64));
+		}
+		check->items[check->num_items].dir = dir;
+		check->items[check->num_items].entry = i;
+		check->problems[check->num_items] = 0;
+		check->last_block[check->num_items] = 0;
+		check->num_items++;
 	}
+}
+
+/*
+* Print a problem of the FAT, the first CHECK_REPORT_LIMIT of each kind
+*/
+void reportFATProblem(uint32_t* count, const char* problem, uint32_t block, uint32_t value)
+{
+	if(++*count <= CHECK_REPORT_LIMIT)
+		printf("Block %u: %s (entry 0x%08x)\n", block, problem, value);
+}
 
-    // get the disk as a map
-	unsigned char* map = mmap((caddr_t)0, 
-				diskimageStats.st_size,
-				 PROT_READ, 
-				 MAP_SHARED, 
-				 fp, 
-				 0);
+/*
+* Check the file system: the FAT chain of every file and directory
+*	against its size and start block, for cycles and for blocks shared
+*	with other files or the metadata, and every FAT entry for values
+*	outside the file system and for allocated blocks used by no file.
+*	The tree is checked one level at a time: the chains of a level are
+*	walked by "threads" threads filling one array of the owner of each
+*	block, then the directories whose chains are sound are read for the
+*	next level. A single pass over the FAT then compares the owners with
+*	the entries. With "repair" the files and directories that cannot be
+*	read are removed, chains and block counts are corrected, the blocks
+*	used by nothing are freed and the metadata blocks are reserved again.
+*	Returns the number of problems found, -1 on error
+*/
+int disk_check(struct disk_image* img, int repair, int threads)
+{
+	struct checkState check;
+	struct dirEntry* entry;
+	struct FDT* dir;
+	pthread_t* workers;
+	uint32_t num_entries;
+	uint32_t block;
+	uint32_t value;
+	uint32_t owner;
+	uint32_t orphans = 0;
+	uint32_t out_of_range = 0;
+	uint32_t metadata = 0;
+	uint32_t files = 0;
+	uint32_t directories = 0;
+	uint32_t bad_files = 0;
+	uint32_t bad_root = 0;
+	int level_start;
+	uint64_t word;
+	bool drop;
+	int bit;
+	int i;
 
-	if(map == MAP_FAILED)
+	if(repair && !img->writable)
 	{
-		perror("mmap()\n");
-		exit(-1);
+		printf("error: %s is open read only\n", img->path);
+		return -1;
 	}
 
-    // open the input file
-    if((rfp = open(inFileName, O_RDONLY)) < 0)
-    {
-        printf("error: could not open %s\n", inFileName);
-        exit(-1);
-    }
+	// the walks read the FAT concurrently, decode it first
+	read_FAT(img);
+	num_entries = img->FAT->num_entries;
 
-    if((fstat(rfp, &infileStats)) == 1)
+	memset(&check, 0, sizeof(struct checkState));
+	check.img = img;
+	check.owner = (uint32_t*)calloc(num_entries, sizeof(uint32_t));
+
+	// the superblock, the FAT and the root directory belong to no file
+	check.owner[0] = OWNER_METADATA;
+	for(block = img->FAT->start_block; block < img->FAT->start_block + img->FAT->num_blocks && block < num_entries; block++)
+		check.owner[block] = OWNER_METADATA;
+	// past its first block, a root read without its chain only guesses
+	for(i=0; i < (int)img->FDT->num_blocks && (i == 0 || !img->FDT->unchained); i++)
 	{
-		perror("fstat()\n");
-		exit(-1);
-	}	
+		if(img->FDT->blocks[i] < num_entries)
+			check.owner[img->FDT->blocks[i]] = OWNER_METADATA;
+	}
+
+	// walk the chains of the tree, one level at a time
+	addCheckItems(&check, img->FDT);
+	for(level_start = 0; level_start < check.num_items; level_start = check.level_end)
+	{
+		check.next_entry = level_start;
+		check.level_end = check.num_items;
+		if(threads <= 1)
+		{
+			checkWorker(&check);
+		}
+		else
+		{
+			workers = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+			for(i=0; i < threads; i++)
+				pthread_create(&workers[i], NULL, checkWorker, &check);
+			for(i=0; i < threads; i++)
+				pthread_join(workers[i], NULL);
+			free(workers);
+		}
 
-	// read evreything and update the file pointer's position
-	fpPosition = read_superblock(map, 0);
-    lseek(fp, fpPosition, SEEK_SET);
+		// the sound directories of the level hold the next one. A directory
+		// looping back to an ancestor shares its blocks and is not read
+		for(i=level_start; i < check.level_end; i++)
+		{
+			entry = dirEntryAt(img, check.items[i].dir, check.items[i].entry);
+			if(!dirEntryIsDirectory(entry->status) || (check.problems[i] & CHECK_UNREADABLE))
+				continue;
+			pthread_mutex_lock(&img->dirs_lock);
+			dir = childDirectory(img, check.items[i].dir, check.items[i].entry);
+			pthread_mutex_unlock(&img->dirs_lock);
+			if(dir != NULL)
+				addCheckItems(&check, dir);
+		}
+	}
 
-    fpPosition = read_FAT(map, 0);  
-    lseek(fp, fpPosition, SEEK_SET);
+	// report the files, by tree level
+	for(i=0; i < check.num_items; i++)
+	{
+		entry = dirEntryAt(img, check.items[i].dir, check.items[i].entry);
+		if(dirEntryIsDirectory(entry->status))
+			directories++;
+		else
+			files++;
+		if(check.problems[i] == 0)
+			continue;
+
+		bad_files++;
+		printf("%s %s%s%.*s:", dirEntryIsDirectory(entry->status)? "Directory" : "File",
+			check.items[i].dir->path, (check.items[i].dir->path[0] != '\0')? "/" : "",
+			DIR_ENTRY_FILE_NAME_SIZE, entry->filename);
+		for(bit=0; bit < NUM_CHECK_PROBLEMS; bit++)
+		{
+			if(check.problems[i] & (1 << bit))
+				printf("%s %s", (check.problems[i] & ((1 << bit) - 1))? "," : "", checkProblemNames[bit]);
+		}
+		if(check.problems[i] & CHECK_NUM_BLOCKS)
+			printf(" (%u blocks recorded, %u needed)", be32toh(entry->num_blocks),
+				blocksForBytes(img, be32toh(entry->file_size)));
+		printf("\n");
+
+		// the entries of a root read without its chain are left as they are
+		if(!repair || check.items[i].dir->unchained)
+			continue;
+		if(check.problems[i] & CHECK_UNREADABLE)
+		{
+			writableDirEntry(img, check.items[i].dir, check.items[i].entry)->status = 0;
+			continue;
+		}
+		if(check.problems[i] & CHECK_LONG)
+			setFATEntry(img, check.last_block[i], BLOCK_END);
+		if(check.problems[i] & CHECK_NUM_BLOCKS)
+			writableDirEntry(img, check.items[i].dir, check.items[i].entry)->num_blocks =
+				htobe32(blocksForBytes(img, be32toh(entry->file_size)));
+	}
 
-    fpPosition = read_FDT(map, 0);
-    lseek(fp, fpPosition, SEEK_SET);
+	// a root read without its chain may be missing the blocks it grew by,
+	// which can not be told apart from those of files: it is left as it is
+	if(img->FDT->unchained)
+	{
+		bad_root = 1;
+		printf("Root directory: broken chain, read as %u blocks from block %u%s\n",
+			img->FDT->num_blocks, img->FDT->start_block, repair? " (not repaired)" : "");
+	}
 
-    // init buffer to 0's
-    memset(&buffer, 0, BLOCK_SIZE);
+	// the metadata blocks must stay reserved; the blocks of the root
+	// directory, the others, may be a chain
+	for(block = 0; block < num_entries; block++)
+	{
+		if(check.owner[block] != OWNER_METADATA)
+			continue;
+		value = fatEntryValue(img, block);
+		if(value == BLOCK_RESERVED || (value != BLOCK_AVAILABLE && block != 0 &&
+			(block < img->FAT->start_block || block >= img->FAT->start_block + img->FAT->num_blocks)))
+		{
+			continue;
+		}
 
-    // make sure file system isn't already full
-    if (firstRootEntryFree == -1 )
-    {
-        printf("ERROR: Could not add file <%s>, filesystem is full\n", inFileName);
-        exit(-1);
-    }
+		reportFATProblem(&metadata, "metadata block is not reserved", block, value);
+		if(repair)
+		{
+			setFATEntry(img, block, BLOCK_RESERVED);
+			if(value == BLOCK_AVAILABLE)
+			{
+				setBlockFree(img, block, false);
+				img->FAT->free_blocks--;
+			}
+			else
+			{
+				img->FAT->allocated_blocks--;
+			}
+			img->FAT->reserved_blocks++;
+		}
+	}
 
-    // find the entry point
-    rootEntryPosition = (firstRootEntryFreeBlock * BLOCK_SIZE) + 
-                        (firstRootEntryFree * DIR_ENTRY_SIZE);
+	// one pass over the allocated blocks, skipping whole words of free ones
+	for(block = 0; block < num_entries; block++)
+	{
+		if(block % 64 == 0)
+		{
+			word = img->FAT->free_map[block / 64];
+			if(num_entries - block < 64)
+				word |= ~(uint64_t)0 << (num_entries - block);
+			if(word == ~(uint64_t)0)
+			{
+				block += 63;
+				continue;
+			}
+		}
 
-    // get next block of diskimage
-    if ((currentBlock = getNextFATEntry(fp, &writeOffset)) == -1 )
-    {
-        printf("error: could not add %s\n", inFileName);
-        exit(-1);
-    }
+		owner = check.owner[block];
+		if(((img->FAT->free_map[block / 64] >> (block % 64)) & 1) || owner == OWNER_METADATA)
+			continue;
 
-    // go to diskimage entry point
-    lseek(fp , rootEntryPosition , SEEK_SET);
+		value = fatEntryValue(img, block);
+		if(value == BLOCK_RESERVED)
+			continue;
 
-    // set status byte
-    buffer[0] = (0x01 | 0x02); 
-    // write status field to disk image
-    write(fp, buffer, DIR_ENTRY_STATUS_SIZE);
+		if(value != BLOCK_END && (value > BLOCK_MAX_ALLOCATED || value >= num_entries))
+			reportFATProblem(&out_of_range, "points outside the file system", block, value);
 
-    // read start block size field
-    auxInt  = htonl(currentBlock);
-    memcpy(&buffer[0], &auxInt, DIR_ENTRY_START_BLOCK_SIZE);
-    // write start block size field to disk image
-    write(fp, buffer, DIR_ENTRY_START_BLOCK_SIZE);
+		// the blocks of no file, or of a file removed above, are freed. A
+		// root read without its chain may own some of them, none is
+		drop = (owner != 0 && repair && (check.problems[owner - 1] & CHECK_UNREADABLE));
+		if(owner == 0)
+			reportFATProblem(&orphans, "allocated but used by no file", block, value);
+		if(repair && !img->FDT->unchained && (owner == 0 || drop))
+		{
+			setFATEntry(img, block, BLOCK_AVAILABLE);
+			releaseFATRun(img, block, 1);
+		}
+	}
 
+	if(orphans > CHECK_REPORT_LIMIT || out_of_range > CHECK_REPORT_LIMIT || metadata > CHECK_REPORT_LIMIT)
+		printf("(only the first %d problems of each kind are listed)\n", CHECK_REPORT_LIMIT);
+	printf("\nFiles checked: %u\n", files);
+	printf("Directories checked: %u\n", directories);
+	printf("Files with problems: %u\n", bad_files);
+	printf("Blocks used by no file: %u\n", orphans);
+	printf("Entries outside the file system: %u\n", out_of_range);
+	printf("Metadata blocks not reserved: %u\n", metadata);
+
+	free(check.owner);
+	free(check.items);
+	free(check.problems);
+	free(check.last_block);
+
+	if(repair && disk_sync(img) < 0)
+		return -1;
+
+	// removed entries leave the filename indexes and removed directories the
+	// path cache, they are read again on demand
+	if(repair && bad_files > 0)
+		forgetDirectories(img);
+	return bad_files + bad_root + orphans + out_of_range + metadata;
+}
 
-    // determine number of blocks required for the infile
-    blocksRequired = infileStats.st_size / BLOCK_SIZE;
-    // add an extra for remaining blocks
-    if(infileStats.st_size % BLOCK_SIZE) blocksRequired++;
-
-    // read the number of blocks field
-    auxInt  = htonl(blocksRequired);
-    memcpy(&buffer[0], &auxInt, DIR_ENTRY_NUM_BLOCKS_SIZE);
-    // write the number of blocks field
-    write(fp, buffer, DIR_ENTRY_NUM_BLOCKS_SIZE);
-
-    // read the file size field
-    auxInt = htonl(infileStats.st_size);
-    memcpy(&buffer[0], &auxInt, DIR_ENTRY_FILE_SIZE_B_SIZE);
-    // write the file size filed
-    write(fp, buffer, DIR_ENTRY_FILE_SIZE_B_SIZE);
-
-    /*
-    printf("getting time info...\n");
-    // get the time of infile's creation
-    now = time(NULL);
-    printf("got current time\n");
-    timeInfo = *gmtime(&now);
-    printf("stored current time\n");
-    auxShort = timeInfo.tm_year + 1900; 
-    auxShort = htons(auxShort);
-
-    // store the creation time data in time struct
-    int offset = 0;
-    // store year
-    memcpy(&buffer[offset], &auxShort, sizeof(short));
-    offset += TIME_YEAR_SIZE;
-
-    // store month
-    buffer[offset] = timeInfo.tm_mon + 1; 
-    offset += TIME_MONTH_SIZE;
-
-    // store day
-    buffer[offset] = timeInfo.tm_mday;
-    offset += TIME_DAY_SIZE;
-
-    // store hour
-    buffer[offset] = timeInfo.tm_hour;
-    offset += TIME_HOUR_SIZE;
-
-    // enable daylight savings time
-    if(!timeInfo.tm_isdst) buffer[offset]++; 
-
-    // store minute
-    buffer[offset] = timeInfo.tm_min;
-    offset += TIME_MINUTE_SIZE;
-
-    // store second 
-    buffer[offset] = timeInfo.tm_sec;
-    offset += TIME_SECOND_SIZE;
-
-    printf("writing time info...\n");
-    // write the creation time data to the diskimage
-    write(fp, buffer, DIR_ENTRY_CREATE_TIME_SIZE);
-    
-    // write the modify time (same as creaion time) to the diskimage
-    write(fp, buffer, DIR_ENTRY_CREATE_TIME_SIZE);
-   */
-
-    //DEBUG: write garbage values (0's) for create and modify times to test rest of the fields
-    // store year
-    int offset = 0;
-    auxShort = 0;
-    memcpy(&buffer[offset], &auxShort, sizeof(short));
-    offset += TIME_YEAR_SIZE;
-
-    // store month
-    buffer[offset] = 0; 
-    offset += TIME_MONTH_SIZE;
-
-    // store day
-    buffer[offset] = 0;
-    offset += TIME_DAY_SIZE;
-
-    // store hour
-    buffer[offset] = 0;
-    offset += TIME_HOUR_SIZE; 
-
-    // store minute
-    buffer[offset] = 0;
-    offset += TIME_MINUTE_SIZE;
-
-    // store second 
-    buffer[offset] = 0;
-    offset += TIME_SECOND_SIZE;
-
-    // write the creation time data to the diskimage
-    write(fp, buffer, DIR_ENTRY_CREATE_TIME_SIZE);
-    
-    // write the modify time (same as creaion time) to the diskimage
-    write(fp, buffer, DIR_ENTRY_CREATE_TIME_SIZE);
+/*
+* Write back pending changes and release the disk image
+*/
+void disk_close(struct disk_image* img)
+{
+	if(img == NULL)
+		return;
 
+	if(img->writable)
+		disk_sync(img);
 
-    // read filename field
-    memset(&buffer, 0, DIR_ENTRY_FILE_NAME_SIZE);
-    memcpy(&buffer, inFileName, strlen(inFileName));
-    // write filename field to diskimage
-    write(fp, buffer, DIR_ENTRY_FILE_NAME_SIZE);
-    
-    // ignore unused bytes
-    memset(&buffer, 0xFF, DIR_ENTRY_UNUSED_SIZE);
+	// an empty journal is removed, one not applied is left for disk_open
+	if(img->journal != NULL)
+	{
+		if(img->journal->fd >= 0)
+		{
+			close(img->journal->fd);
+			if(!img->journal->pending)
+				unlink(img->journal->path);
+		}
+		free(img->journal->buffer);
+		free(img->journal->path);
+		free(img->journal);
+	}
 
-    // go to beginning of input file
-    lseek(rfp, 0, SEEK_SET);
-    
-    for (i=0; i < blocksRequired; i++)
-    {
-    	// go to next block in disk image
-    	lseek(fp, currentBlock*BLOCK_SIZE, SEEK_SET);
+	free_FDT(img);
+	pthread_mutex_destroy(&img->dirs_lock);
+	free_FAT(img);
+	free_fileSystem(img);
 
-    	// read a block from input file
-        bytesRead = read(rfp, buffer, BLOCK_SIZE);
-        totalBytesRead += bytesRead;
+	munmap(img->map, img->map_size);
+	close(img->fd);
+	free(img->path);
+	free(img->stats);
+	free(img);
+}
 
-        // write the block to diskimage
-        write(fp, buffer, bytesRead);
+/*
+* Print the superblock and FAT information
+*/
+void disk_info(struct disk_image* img)
+{
+	// the statistics cover the whole FAT
+	read_FAT(img);
+
+	printf("\nSuper block information:\n");
+	printf("Block size: %d\n", img->fileSystem->block_size);
+	printf("Block count: %d\n", img->fileSystem->num_blocks);
+	printf("FAT starts: %d\n", img->FAT->start_block);
+	printf("FAT blocks: %d\n",img->FAT->num_blocks);
+	printf("Root directory start: %d\n", img->FDT->start_block);	
+	printf("Root directory blocks: %d\n", img->FDT->num_blocks);
+
+	printf("\nFAT information:\n");
+	printf("Free Blocks: %d\n", img->FAT->free_blocks);
+	printf("Reserved Blocks: %d\n", img->FAT->reserved_blocks);
+	printf("Allocated Blocks: %d\n", img->FAT->allocated_blocks);
+}
 
-        // if this is the last FAT entry
-        if(totalBytesRead >= infileStats.st_size)
-        {
-        	// update the FAT entry
-            FAT->entries[currentBlock] = BLOCK_END;
-
-            // go to write offset
-            lseek(fp , writeOffset, SEEK_SET);
-            // read the last entry
-            memcpy(&buffer, &FAT->entries[currentBlock], FAT_ENTRY_SIZE);
-            // write the last entry to the diskimage
-            write(fp, buffer, FAT_ENTRY_SIZE);
-        }
-        else
-        {
-        	// update the FAT entry
-            previousBlock  = currentBlock;
-            auxWriteOffset = writeOffset;
-
-            // go to offset in diskimage
-            lseek(fp , auxWriteOffset, SEEK_SET);
-            auxInt = htonl(currentBlock);
-            // read the FAT entry
-            memcpy(&buffer[0], &auxInt, FAT_ENTRY_SIZE);
-            // write the entry to the diskimage
-            write(fp, buffer, FAT_ENTRY_SIZE);
-
-            // get the next block
-            currentBlock = getNextFATEntry(fp, &writeOffset);
-
-            if (currentBlock == -1 )
-            {
-                printf("error: could not add %s\n", inFileName);
-                exit(-1);
-            }
+/*
+* Print how fragmented the files and the free space are: extent counts,
+*	the average extent length, the largest free run and a histogram of the
+*	free runs by length. "per_file" adds the extents of every file
+*/
+void disk_frag_info(struct disk_image* img, int per_file)
+{
+	struct fragReport report;
+	uint32_t low;
+	int i;
 
-            // go to offset in diskimage
-            lseek(fp , auxWriteOffset, SEEK_SET);
-            auxInt = htonl(currentBlock);
-            // read the entry
-            memcpy(&buffer[0], &auxInt, FAT_ENTRY_SIZE);
-            // write the entry to the diskaimge
-            write(fp, buffer, FAT_ENTRY_SIZE);
-            
-            // update the FAT entries
-            FAT->entries[previousBlock] = currentBlock;
-        }
-    }
+	measureFragmentation(img, &report, per_file);
+
+	printf("\nFragmentation information:\n");
+	printFragmentation(&report);
+
+	printf("\nFree space histogram:\n%-23s %10s %12s\n", "Run length", "Runs", "Blocks");
+	for(i=1; i < 33; i++)
+	{
+		if(report.histogram_runs[i] == 0)
+			continue;
+		low = (uint32_t)1 << (i - 1);
+		printf("%10u - %-10u %10u %12llu\n", low, low + (low - 1), report.histogram_runs[i],
+			(unsigned long long)report.histogram_blocks[i]);
+	}
+}
+
+/*
+* Print the information of every entry in use in the directory "path",
+*	the root directory if it is NULL, to "out". Returns 0 on success, -1
+*	if there is no such directory
+*/
+int disk_list(struct disk_image* img, const char* path, FILE* out)
+{
+	struct dirEntry* entry;
+	struct FDT* dir = img->FDT;
+	char* normal;
+	int length;
+	int i;
+
+	if(path != NULL)
+	{
+		normal = (char*)malloc(strlen(path) + 1);
+		length = normalizePath(path, normal);
+		dir = (length < 0)? NULL : lookupDirectory(img, normal, length, false);
+		free(normal);
+		if(dir == NULL)
+		{
+			printf("Directory not found\n");
+			return -1;
+		}
+	}
+
+	for(i=0; i < dir->num_entries; i++)
+	{
+		entry = dirEntryAt(img, dir, i);
+
+		// print information on entries in use
+		if( dirEntryIsUsed(entry->status) )
+		{
+			fprintf(out, "%c %10d %30.*s %4d/%02d/%02d %02d:%02d:%02d\n",
+				   dirEntryIsFile(entry->status)?'F':'D',
+				   be32toh(entry->file_size),
+				   DIR_ENTRY_FILE_NAME_SIZE,
+				   entry->filename,
+				   be16toh(entry->modify_time.year),
+				   entry->modify_time.month,
+				   entry->modify_time.day,
+				   entry->modify_time.hour,
+				   entry->modify_time.minutes,
+				   entry->modify_time.seconds);
+		}
+	}
+	return 0;
+}
+
+/*
+* Fill "st" with the information of the file named "filename".
+*	Returns 0 on success, -1 if there is no such file
+*/
+int disk_stat(struct disk_image* img, char* filename, struct disk_stat* st)
+{
+	struct dirEntry* entry;
+
+	if((entry = findEntryInFDT(img, filename)) == NULL)
+		return -1;
+
+	memset(st, 0, sizeof(struct disk_stat));
+	memcpy(st->filename, entry->filename, DIR_ENTRY_FILE_NAME_SIZE);
+	st->status = entry->status;
+	st->start_block = be32toh(entry->start_block);
+	st->num_blocks = be32toh(entry->num_blocks);
+	st->file_size = be32toh(entry->file_size);
+	st->create_time = mktimeStruct(&entry->create_time);
+	st->modify_time = mktimeStruct(&entry->modify_time);
+	return 0;
+}
 
+/*
+* Parse the argument of a --stats option: none or "text" for a table,
+*	"json" for a JSON object. Returns DISK_STATS_TEXT or DISK_STATS_JSON,
+*	-1 if the argument is invalid
+*/
+int parse_stats_option(const char* arg)
+{
+	if(arg == NULL || !strcmp(arg, "text"))
+		return DISK_STATS_TEXT;
+	if(!strcmp(arg, "json"))
+		return DISK_STATS_JSON;
+	printf("error: unknown statistics format %s\n", arg);
+	return -1;
+}
+
+/*
+* Parse the argument of a --mmap option: "none", none or "end", or "file"
+*	for no msync, one at disk_sync or one per file. Returns the flags for
+*	disk_open, -1 if the argument is invalid
+*/
+int parse_mmap_option(const char* arg)
+{
+	if(arg == NULL || !strcmp(arg, "end"))
+		return DISK_MMAP;
+	if(!strcmp(arg, "file"))
+		return DISK_MMAP | DISK_MSYNC_FILE;
+	if(!strcmp(arg, "none"))
+		return DISK_MMAP | DISK_MSYNC_NONE;
+	printf("error: unknown msync mode %s\n", arg);
+	return -1;
+}
+
+/*
+* Parse a byte count with an optional K, M, G or T suffix, for diskformat
+*	and the benchmark. The count must end "text" or be followed by
+*	"separator". Returns the count, 0 if it is invalid
+*/
+uint64_t parse_size(const char* text, char separator)
+{
+	char* end;
+	uint64_t size = strtoull(text, &end, 10);
+
+	switch(*end)
+	{
+		case 'T': case 't': size <<= 10;
+			/* fall through */
+		case 'G': case 'g': size <<= 10;
+			/* fall through */
+		case 'M': case 'm': size <<= 10;
+			/* fall through */
+		case 'K': case 'k': size <<= 10;
+			end++;
+			break;
+	}
+	return (*end == '\0' || (separator != '\0' && *end == separator))? size : 0;
+}
+
+/*
+* Print the time spent in each phase and the counters collected since
+*	the image was opened with DISK_STATS, as a table or as a JSON object
+*/
+void disk_print_stats(struct disk_image* img, FILE* out, int format)
+{
+	struct diskStats* stats = img->stats;
+	int i;
+
+	if(stats == NULL)
+		return;
 
+	if(format == DISK_STATS_JSON)
+	{
+		fprintf(out, "{\"image\": \"%s\", \"phases\": {", img->path);
+		for(i=0; i < NUM_PHASES; i++)
+		{
+			fprintf(out, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu}", i? ", " : "", phaseNames[i],
+				(unsigned long long)stats->phase_calls[i], (unsigned long long)stats->phase_ns[i]);
+		}
+		fprintf(out, "}, \"counters\": {");
+		for(i=0; i < NUM_COUNTERS; i++)
+		{
+			fprintf(out, "%s\"%s\": %llu", i? ", " : "", counterNames[i],
+				(unsigned long long)stats->counters[i]);
+		}
+		fprintf(out, "}}\n");
+		return;
+	}
 
+	fprintf(out, "\nStatistics of %s:\n", img->path);
+	fprintf(out, "%-20s %12s %14s\n", "Phase", "Calls", "Time (ms)");
+	for(i=0; i < NUM_PHASES; i++)
+	{
+		if(stats->phase_calls[i] == 0)
+			continue;
+		fprintf(out, "%-20s %12llu %14.3f\n", phaseNames[i],
+			(unsigned long long)stats->phase_calls[i], stats->phase_ns[i] / 1e6);
+	}
+	fprintf(out, "%-20s %12s\n", "Counter", "Value");
+	for(i=0; i < NUM_COUNTERS; i++)
+		fprintf(out, "%-20s %12llu\n", counterNames[i], (unsigned long long)stats->counters[i]);
 }
 
 ////////////////////////////////////////
\ No newline at end of file
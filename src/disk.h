@@ -1,26 +1,89 @@
 ///////////////////////////////////////
 // Headers
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <endian.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
+#include <pthread.h>
+///////////////////////////////////////
+
+///////////////////////////////////////
+// Definitions
+// Flags for disk_open
+#define DISK_READ_ONLY	0x00
+#define DISK_WRITE		0x01
+#define DISK_STATS		0x02	// collect the statistics of disk_print_stats
+#define DISK_MMAP		0x04	// with DISK_WRITE, store the changes into a writable map
+#define DISK_MSYNC_FILE	0x08	// with DISK_MMAP, msync after every disk_put
+#define DISK_MSYNC_NONE	0x10	// with DISK_MMAP, never msync, the kernel writes the map back
+#define DISK_JOURNAL	0x20	// with DISK_WRITE, commit each disk_sync through a journal
+// Flags for disk_format
+#define DISK_PREALLOCATE	0x01
+// Flags for disk_put
+#define DISK_OVERWRITE		0x01	// replace a file of the same name
+// Default socket of diskd and diskc
+#define DISKD_SOCKET	"/tmp/diskd.sock"
+// Formats for disk_print_stats
+#define DISK_STATS_TEXT	0
+#define DISK_STATS_JSON	1
+
+// An open disk image, see disk_open
+struct disk_image;
+
+// A run of bytes of the disk image, see disk_map_range
+struct disk_range
+{
+	uint64_t offset;
+	uint64_t length;
+};
+
+// Information on a file of a disk image, see disk_stat
+struct disk_stat
+{
+	char filename[32];
+	unsigned char status;
+	uint32_t start_block;
+	uint32_t num_blocks;
+	uint32_t file_size;
+	time_t create_time;
+	time_t modify_time;
+};
 ///////////////////////////////////////
 
 ///////////////////////////////////////
 // Prototypes
-void free_fileSystem();
-int read_superblock(unsigned char*,int);
-int read_FAT(unsigned char*,int);
-int read_FDT(unsigned char*, int);
-void get_file(unsigned char*, char*,char*);
-void put_file(char*, char*);
+int disk_format(const char*, uint32_t, uint32_t, uint32_t, int);
+struct disk_image* disk_open(const char*, int);
+void disk_close(struct disk_image*);
+void disk_info(struct disk_image*);
+void disk_frag_info(struct disk_image*, int);
+int disk_list(struct disk_image*, const char*, FILE*);
+int disk_stat(struct disk_image*, char*, struct disk_stat*);
+int disk_get(struct disk_image*, char*, char*);
+ssize_t disk_pread(struct disk_image*, char*, void*, size_t, uint64_t);
+int disk_map_range(struct disk_image*, char*, uint64_t, uint64_t, struct disk_range**);
+int disk_fd(struct disk_image*);
+int disk_put(struct disk_image*, char*, int);
+int disk_remove(struct disk_image*, char*);
+int disk_sync(struct disk_image*);
+int disk_defrag(struct disk_image*);
+int disk_check(struct disk_image*, int, int);
+char** read_name_list(const char*, int*);
+int parse_stats_option(const char*);
+int parse_mmap_option(const char*);
+uint64_t parse_size(const char*, char);
+void disk_print_stats(struct disk_image*, FILE*, int);
 ///////////////////////////////////////
@@ -0,0 +1,174 @@
+/* Part10: Client of diskd, send one request and write its response
+*	The body of the response goes to the standard output or a file; errors
+*	go to the standard error so that they never mix with file data
+*/
+
+//////////////////////////////////////////
+// Headers
+#include "disk.h"
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Definitions
+#define REQUEST_MAX		512		// longest request line, as diskd reads it
+#define COPY_BYTES		(1 << 16)
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+int connectSocket(const char*);
+void showUsage(void);
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+
+/*
+* Connect to the diskd listening at "path". Returns the socket, -1 on error
+*/
+int connectSocket(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+		connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "error: could not connect to %s: %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void showUsage(void)
+{
+	printf("Usage: $./diskc [-s socket] [-o outfile] list [directory]\n"
+		   "       $./diskc [-s socket] [-o outfile] stat <filename>\n"
+		   "       $./diskc [-s socket] [-o outfile] get <filename>\n"
+		   "       $./diskc [-s socket] [-o outfile] range <filename> <offset> <length>\n"
+		   "  -s  path of the diskd socket (default %s)\n"
+		   "  -o  write the response to outfile instead of the standard output\n", DISKD_SOCKET);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* socket_path = DISKD_SOCKET;
+	char* outname = NULL;		// Filename of the output, NULL for stdout
+	char request[REQUEST_MAX];
+	char line[REQUEST_MAX];
+	unsigned char* buffer;
+	unsigned long long remaining;
+	size_t length = 0;
+	ssize_t n;
+	int fd;
+	int out = STDOUT_FILENO;
+	int opt;
+	int i;
+
+	while((opt = getopt(argc, argv, "s:o:")) != -1)
+	{
+		switch(opt)
+		{
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'o':
+				outname = optarg;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+
+	if(argc - optind < 1 || argc - optind > 4)
+	{
+		showUsage();
+		exit(-1);
+	}
+
+	// the request is the arguments on one line, the command in upper case
+	for(i=optind; i < argc; i++)
+	{
+		if(strlen(argv[i]) + length + 2 > sizeof(request) || strpbrk(argv[i], " \t\r\n") != NULL)
+		{
+			fprintf(stderr, "error: invalid argument %s\n", argv[i]);
+			exit(-1);
+		}
+		length += sprintf(request + length, "%s%s", (i > optind)? " " : "", argv[i]);
+	}
+	for(i=0; request[i] != ' ' && request[i] != '\0'; i++)
+		request[i] = toupper((unsigned char)request[i]);
+	request[length++] = '\n';
+
+	if((fd = connectSocket(socket_path)) < 0)
+		exit(-1);
+	if(send(fd, request, length, MSG_NOSIGNAL) != (ssize_t)length)
+	{
+		fprintf(stderr, "error: could not send the request\n");
+		close(fd);
+		exit(-1);
+	}
+	shutdown(fd, SHUT_WR);
+
+	// the response line, read a byte at a time so that no data is consumed
+	for(length = 0; length < sizeof(line) - 1; length++)
+	{
+		if(recv(fd, &line[length], 1, 0) != 1 || line[length] == '\n')
+			break;
+	}
+	line[length] = '\0';
+
+	if(strncmp(line, "OK ", 3) != 0 || sscanf(line + 3, "%llu", &remaining) != 1)
+	{
+		fprintf(stderr, "%s\n", (line[0] != '\0')? line : "error: no response");
+		close(fd);
+		return 1;
+	}
+
+	if(outname != NULL && (out = open(outname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+	{
+		fprintf(stderr, "error: could not open %s\n", outname);
+		close(fd);
+		exit(-1);
+	}
+
+	// copy the body
+	buffer = (unsigned char*)malloc(COPY_BYTES);
+	while(remaining > 0)
+	{
+		if((n = recv(fd, buffer, (remaining < COPY_BYTES)? remaining : COPY_BYTES, 0)) <= 0)
+			break;
+		if(write(out, buffer, n) != n)
+		{
+			fprintf(stderr, "error: could not write the response\n");
+			break;
+		}
+		remaining -= n;
+	}
+	free(buffer);
+	close(fd);
+	if(out != STDOUT_FILENO)
+		close(out);
+
+	if(remaining > 0)
+	{
+		fprintf(stderr, "error: the response was cut short\n");
+		return -1;
+	}
+	return 0;
+}
+
+//////////////////////////////////////////
@@ -0,0 +1,85 @@
+/* Part7: Check the consistency of the file system and optionally repair it
+*/
+
+//////////////////////////////////////////
+// Headers
+#include "disk.h"
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Globals
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+int main(int argc, char* argv[])
+{
+	char* diskimg;				// Filename of disk image
+	struct disk_image* img;		// The opened disk image
+	int repair = 0;				// Fix the problems found
+	int num_threads;			// Number of chain walks at once
+	int stats = -1;				// Format of the statistics, -1 for none
+	struct option options[] = { {"stats", optional_argument, NULL, 's'}, {NULL, 0, NULL, 0} };
+	int problems;
+	int opt;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while((opt = getopt_long(argc, argv, "rj:", options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'r':
+				repair = 1;
+				break;
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 's':
+				if((stats = parse_stats_option(optarg)) < 0)
+					num_threads = 0;
+				break;
+			default:
+				num_threads = 0;
+		}
+	}
+
+	if(num_threads < 1 || argc - optind != 1)
+	{
+		printf("Usage: $./diskcheck [-r] [-j threads] [--stats[=json]] <disk.img>\n"
+			   "  -r  repair: remove the files that cannot be read, fix chains and block\n"
+			   "      counts, free the blocks used by no file\n"
+			   "  -j  chain walks at once (default: one per CPU)\n");
+		exit(-1);
+	}
+
+	diskimg = argv[optind];
+
+	// A repair is committed through the journal
+	if((img = disk_open(diskimg, (repair? DISK_WRITE | DISK_JOURNAL : DISK_READ_ONLY) |
+		((stats >= 0)? DISK_STATS : 0))) == NULL)
+	{
+		exit(-1);
+	}
+
+	problems = disk_check(img, repair, num_threads);
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
+
+	disk_close(img);
+
+	// 0 when the file system is consistent or was repaired
+	if(problems < 0)
+		return -1;
+	return (problems > 0 && !repair)? 1 : 0;
+}
+
+//////////////////////////////////////////
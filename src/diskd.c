@@ -0,0 +1,510 @@
+/* Part9: Serve the files of a disk image over a Unix domain socket
+*	The image is opened and its metadata read once, then one epoll loop
+*	serves any number of clients. A request is one line:
+*		LIST [directory]
+*		STAT <filename>
+*		GET <filename>
+*		RANGE <filename> <offset> <length>
+*	and its response is "OK <length>" and a newline followed by <length>
+*	bytes, or "ERR <message>" and a newline. File data is sent with
+*	sendfile straight from the image, it is never copied by the server.
+*	Requests of a client are served in order, the next one is read once
+*	the response to the previous one is sent
+*/
+
+//////////////////////////////////////////
+// Headers
+#include "disk.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Definitions
+#define REQUEST_MAX		512		// longest request line, with its newline
+#define MAX_EVENTS		64		// events handled per epoll_wait
+
+// A connected client and the response it is being sent
+struct client
+{
+	int fd;
+	uint32_t events;			// the epoll events waited for
+	char request[REQUEST_MAX];	// bytes received and not served yet
+	size_t request_len;
+	bool closing;				// the client sent all its requests
+	char* head;					// the response line and a small body, NULL if none
+	size_t head_len;
+	size_t head_sent;
+	struct disk_range* ranges;	// then the runs of the image holding the file data
+	int num_ranges;
+	int next_range;
+	uint64_t range_sent;		// bytes of ranges[next_range] sent
+};
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+int listenSocket(const char*);
+void setResponse(struct client*, const char*, size_t, uint64_t);
+void setError(struct client*, const char*, ...);
+void serveRequest(struct client*, char*);
+int sendResponse(struct client*);
+void watchClient(struct client*, uint32_t);
+void closeClient(struct client*);
+void acceptClients(void);
+void handleClient(struct client*, uint32_t);
+void stopServer(int);
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Globals
+struct disk_image* img;			// The served disk image
+int epfd;						// The epoll instance
+int listenfd;					// The listening socket
+bool accepting = true;			// false while out of file descriptors
+volatile sig_atomic_t stopping = 0;
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+
+/*
+* Create the listening socket at "path", replacing a stale one.
+*	Returns the socket, -1 on error
+*/
+int listenSocket(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("error: the socket path %s is too long\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+		bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		printf("error: could not listen on %s: %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+* Answer with "OK", the "body_len" bytes of "body" and "data_len" more
+*	bytes of file data from the ranges of the client
+*/
+void setResponse(struct client* c, const char* body, size_t body_len, uint64_t data_len)
+{
+	char line[32];
+	int line_len;
+
+	line_len = snprintf(line, sizeof(line), "OK %llu\n", (unsigned long long)(body_len + data_len));
+	c->head = (char*)malloc(line_len + body_len);
+	memcpy(c->head, line, line_len);
+	memcpy(c->head + line_len, body, body_len);
+	c->head_len = line_len + body_len;
+	c->head_sent = 0;
+}
+
+/*
+* Answer with "ERR" and a message
+*/
+void setError(struct client* c, const char* format, ...)
+{
+	char message[REQUEST_MAX + 64];
+	va_list args;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(message, sizeof(message) - 1, format, args);
+	va_end(args);
+	if(length > (int)sizeof(message) - 2)
+		length = sizeof(message) - 2;
+
+	c->head = (char*)malloc(length + 6);
+	c->head_len = sprintf(c->head, "ERR %.*s\n", length, message);
+	c->head_sent = 0;
+}
+
+/*
+* Prepare the response to the request "line", without its newline
+*/
+void serveRequest(struct client* c, char* line)
+{
+	struct disk_stat st;
+	char* words[6];
+	char* save;
+	char* end;
+	char* body;
+	size_t body_len;
+	uint64_t offset = 0;
+	uint64_t length = UINT64_MAX;
+	uint64_t total = 0;
+	FILE* out;
+	int num_words = 0;
+	int i;
+
+	for(words[0] = strtok_r(line, " \t\r", &save); words[num_words] != NULL && num_words < 5;
+		words[++num_words] = strtok_r(NULL, " \t\r", &save))
+		;
+
+	if(num_words == 0)
+	{
+		setError(c, "empty request");
+	}
+	else if(!strcmp(words[0], "LIST") && num_words <= 2)
+	{
+		out = open_memstream(&body, &body_len);
+		if(disk_list(img, (num_words == 2)? words[1] : NULL, out) < 0)
+		{
+			fclose(out);
+			setError(c, "directory not found");
+		}
+		else
+		{
+			fclose(out);
+			setResponse(c, body, body_len, 0);
+		}
+		free(body);
+	}
+	else if(!strcmp(words[0], "STAT") && num_words == 2)
+	{
+		if(disk_stat(img, words[1], &st) < 0)
+		{
+			setError(c, "file not found");
+			return;
+		}
+		out = open_memstream(&body, &body_len);
+		fprintf(out, "name: %.31s\ntype: %s\nsize: %u\nstart_block: %u\nblocks: %u\ncreated: %lld\nmodified: %lld\n",
+			st.filename, (st.status & 0x02)? "file" : "directory", st.file_size, st.start_block,
+			st.num_blocks, (long long)st.create_time, (long long)st.modify_time);
+		fclose(out);
+		setResponse(c, body, body_len, 0);
+		free(body);
+	}
+	else if((!strcmp(words[0], "GET") && num_words == 2) || (!strcmp(words[0], "RANGE") && num_words == 4))
+	{
+		if(num_words == 4)
+		{
+			offset = strtoull(words[2], &end, 10);
+			if(*end == '\0')
+				length = strtoull(words[3], &end, 10);
+			if(*end != '\0' || words[2][0] == '-' || words[3][0] == '-')
+			{
+				setError(c, "invalid range");
+				return;
+			}
+		}
+		c->num_ranges = disk_map_range(img, words[1], offset, length, &c->ranges);
+		if(c->num_ranges < 0)
+		{
+			c->num_ranges = 0;
+			setError(c, "file not found");
+			return;
+		}
+		for(i=0; i < c->num_ranges; i++)
+			total += c->ranges[i].length;
+		c->next_range = 0;
+		c->range_sent = 0;
+		setResponse(c, "", 0, total);
+	}
+	else
+	{
+		setError(c, "unknown request %s", words[0]);
+	}
+}
+
+/*
+* Send as much of the response as the socket takes. Returns 1 once it is
+*	all sent, 0 if the socket is full, -1 on error
+*/
+int sendResponse(struct client* c)
+{
+	struct disk_range* range;
+	off_t offset;
+	ssize_t n;
+
+	while(c->head_sent < c->head_len)
+	{
+		if((n = send(c->fd, c->head + c->head_sent, c->head_len - c->head_sent, MSG_NOSIGNAL)) < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK)? 0 : -1;
+		c->head_sent += n;
+	}
+
+	// the file data goes from the image to the socket in the kernel
+	while(c->next_range < c->num_ranges)
+	{
+		range = &c->ranges[c->next_range];
+		offset = range->offset + c->range_sent;
+		if((n = sendfile(c->fd, disk_fd(img), &offset, range->length - c->range_sent)) < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK)? 0 : -1;
+		// the image is shorter than its FAT says
+		if(n == 0)
+			return -1;
+		c->range_sent += n;
+		if(c->range_sent == range->length)
+		{
+			c->next_range++;
+			c->range_sent = 0;
+		}
+	}
+
+	free(c->head);
+	free(c->ranges);
+	c->head = NULL;
+	c->ranges = NULL;
+	c->num_ranges = 0;
+	return 1;
+}
+
+/*
+* Wait for "events" on the socket of the client
+*/
+void watchClient(struct client* c, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if(c->events == events)
+		return;
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+}
+
+/*
+* Disconnect a client. A server out of file descriptors accepts again
+*/
+void closeClient(struct client* c)
+{
+	struct epoll_event ev;
+
+	close(c->fd);
+	free(c->head);
+	free(c->ranges);
+	free(c);
+
+	if(!accepting)
+	{
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+		accepting = true;
+	}
+}
+
+/*
+* Accept every pending connection
+*/
+void acceptClients(void)
+{
+	struct epoll_event ev;
+	struct client* c;
+	int fd;
+
+	while((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		c = (struct client*)calloc(1, sizeof(struct client));
+		c->fd = fd;
+		c->events = EPOLLIN;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	// stop listening until a client leaves, rather than spin on the backlog
+	if(errno == EMFILE || errno == ENFILE)
+	{
+		printf("warning: out of file descriptors, not accepting clients\n");
+		epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+		accepting = false;
+	}
+}
+
+/*
+* Read the requests of a client and send their responses, one at a time
+*/
+void handleClient(struct client* c, uint32_t events)
+{
+	char* newline;
+	size_t length;
+	ssize_t n;
+	int sent;
+
+	if(events & EPOLLERR)
+	{
+		closeClient(c);
+		return;
+	}
+
+	// finish the response being sent
+	if(c->head != NULL)
+	{
+		if((sent = sendResponse(c)) < 0)
+		{
+			closeClient(c);
+			return;
+		}
+		if(sent == 0)
+			return;
+	}
+
+	if(events & (EPOLLIN | EPOLLHUP))
+	{
+		n = recv(c->fd, c->request + c->request_len, REQUEST_MAX - c->request_len, 0);
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			c->closing = true;
+		else if(n > 0)
+			c->request_len += n;
+	}
+
+	// serve the complete requests received
+	while((newline = (char*)memchr(c->request, '\n', c->request_len)) != NULL)
+	{
+		*newline = '\0';
+		serveRequest(c, c->request);
+		length = newline + 1 - c->request;
+		memmove(c->request, newline + 1, c->request_len - length);
+		c->request_len -= length;
+
+		if((sent = sendResponse(c)) < 0)
+		{
+			closeClient(c);
+			return;
+		}
+		if(sent == 0)
+		{
+			watchClient(c, EPOLLOUT);
+			return;
+		}
+	}
+
+	if(c->request_len == REQUEST_MAX)
+	{
+		// the response is lost with the connection, the request is invalid anyway
+		closeClient(c);
+		return;
+	}
+	if(c->closing)
+	{
+		closeClient(c);
+		return;
+	}
+	watchClient(c, EPOLLIN);
+}
+
+/*
+* Stop the event loop on SIGINT and SIGTERM
+*/
+void stopServer(int signum)
+{
+	(void)signum;
+	stopping = 1;
+}
+
+int main(int argc, char* argv[])
+{
+	char* diskimg;				// Filename of disk image
+	const char* socket_path = DISKD_SOCKET;
+	int stats = -1;				// Format of the statistics, -1 for none
+	struct option options[] = { {"stats", optional_argument, NULL, 'S'}, {NULL, 0, NULL, 0} };
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev;
+	struct sigaction action;
+	int status = 0;
+	int opt;
+	int n;
+	int i;
+
+	while((opt = getopt_long(argc, argv, "s:", options, NULL)) != -1)
+	{
+		if(opt == 's')
+			socket_path = optarg;
+		else if(opt != 'S' || (stats = parse_stats_option(optarg)) < 0)
+			argc = 0;
+	}
+
+	if(argc - optind != 1)
+	{
+		printf("Usage: $./diskd [-s socket] [--stats[=json]] <disk.img>\n"
+			   "  -s  path of the socket (default %s)\n"
+			   "  The image is served as it is when diskd starts; restart it after\n"
+			   "  changing the image\n", DISKD_SOCKET);
+		exit(-1);
+	}
+
+	diskimg = argv[optind];
+
+	// Open the image and read its metadata, once
+	if((img = disk_open(diskimg, DISK_READ_ONLY | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+		exit(-1);
+
+	if((listenfd = listenSocket(socket_path)) < 0 || (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		disk_close(img);
+		exit(-1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+	// a client leaving early must not stop the server
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
+	action.sa_handler = stopServer;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	printf("serving %s on %s\n", diskimg, socket_path);
+	fflush(stdout);
+
+	while(!stopping)
+	{
+		if((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			status = -1;
+			break;
+		}
+		for(i=0; i < n; i++)
+		{
+			if(events[i].data.ptr == NULL)
+				acceptClients();
+			else
+				handleClient((struct client*)events[i].data.ptr, events[i].events);
+		}
+	}
+
+	// the clients still connected are dropped with the process
+	close(listenfd);
+	unlink(socket_path);
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
+	disk_close(img);
+
+	return status;
+}
+
+//////////////////////////////////////////
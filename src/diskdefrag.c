@@ -0,0 +1,61 @@
+/* Part6: Move the fragmented files of the file system into contiguous runs
+*/
+
+//////////////////////////////////////////
+// Headers
+#include "disk.h"
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Globals
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+int main(int argc, char* argv[])
+{
+	char* diskimg;				// Filename of disk image
+	struct disk_image* img;		// The opened disk image
+	int stats = -1;				// Format of the statistics, -1 for none
+	struct option options[] = { {"stats", optional_argument, NULL, 's'}, {NULL, 0, NULL, 0} };
+	int moved;
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		if(opt != 's' || (stats = parse_stats_option(optarg)) < 0)
+			argc = 0;
+	}
+
+	if(argc - optind != 1)
+	{
+		printf("Usage: $./diskdefrag [--stats[=json]] <disk.img>\n");
+		exit(-1);
+	}
+
+	diskimg = argv[optind];
+
+	// Open the image for writing
+	if((img = disk_open(diskimg, DISK_WRITE | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+		exit(-1);
+
+	// relocate the fragmented files, reporting before and after
+	moved = disk_defrag(img);
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
+
+	disk_close(img);
+
+	return (moved < 0)? -1 : 0;
+}
+
+//////////////////////////////////////////
@@ -0,0 +1,80 @@
+/* Part5: Create an empty disk image with the given geometry
+*/
+
+//////////////////////////////////////////
+// Headers
+#include "disk.h"
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Globals
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+
+int main(int argc, char* argv[])
+{
+	char* diskimg;					// Filename of disk image
+	uint32_t block_size = 512;		// Block size in bytes
+	uint64_t num_blocks = 0;		// Blocks in the file system
+	uint64_t image_size = 0;		// or the size of the image in bytes
+	uint32_t root_blocks = 8;		// Blocks of the root directory
+	int flags = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:n:s:r:p")) != -1)
+	{
+		switch(opt)
+		{
+			case 'b':
+				block_size = atoi(optarg);
+				break;
+			case 'n':
+				num_blocks = strtoull(optarg, NULL, 10);
+				break;
+			case 's':
+				image_size = parse_size(optarg, '\0');
+				break;
+			case 'r':
+				root_blocks = atoi(optarg);
+				break;
+			case 'p':
+				flags |= DISK_PREALLOCATE;
+				break;
+			default:
+				num_blocks = image_size = 0;
+		}
+	}
+
+	if(image_size && block_size)
+		num_blocks = image_size / block_size;
+
+	if(argc - optind != 1 || num_blocks == 0 || num_blocks > UINT32_MAX)
+	{
+		printf("Usage: $./diskformat [-b blocksize] [-r rootblocks] [-p] -n <blocks> <disk.img>\n"
+			   "       $./diskformat [-b blocksize] [-r rootblocks] [-p] -s <size>[K|M|G|T] <disk.img>\n"
+			   "  -b  block size in bytes, a power of 2 (default 512)\n"
+			   "  -r  blocks of the root directory (default 8)\n"
+			   "  -p  allocate the image's space instead of creating it sparse\n");
+		exit(-1);
+	}
+
+	diskimg = argv[optind];
+
+	if(disk_format(diskimg, block_size, num_blocks, root_blocks, flags) != 0)
+		exit(-1);
+
+	return 0;
+}
+
+
+//////////////////////////////////////////
@@ -9,72 +9,124 @@
 
 //////////////////////////////////////////
 // Prototypes
-
+void* getWorker(void*);
 //////////////////////////////////////////
 
 
 //////////////////////////////////////////
 // Globals
-
+// Queue of files shared by the worker threads
+struct disk_image* img;		// The opened disk image, shared read only
+char* diskimg;				// Filename of disk image
+char** names;				// Filenames of the files to be sent
+int num_names;
+int next_name = 0;			// next file of the queue to copy
+int failed = 0;				// number of files that could not be copied
 //////////////////////////////////////////
 
 
 //////////////////////////////////////////
 // Functions
-int main(int argc, char* argv[])
+/*
+* Copy files from the queue until it is empty
+*/
+void* getWorker(void* arg)
 {
-	char* diskimg;			// Filename of disk image
-	char* target_filename;	// Filename of file to be sent
-	int fd;					// File descriptor of disk image
-	struct stat fileStats;	// Statistics of disk image
-	unsigned char* map;		// Map of the disk image as array of bytes
+	char* outname;
+	int i;
 
-	if(argc != 3)
+	(void)arg;
+	while((i = __atomic_fetch_add(&next_name, 1, __ATOMIC_RELAXED)) < num_names)
 	{
-		printf("Usage: $./diskget <disk.img> <copyfilename>\n");
-		exit(-1);
+		// a file of a subdirectory is copied to the current directory
+		outname = strrchr(names[i], '/');
+		outname = (outname != NULL)? outname + 1 : names[i];
+
+		printf("copying %s from %s...\n", names[i], diskimg);
+		if(disk_get(img, names[i], outname) != 0)
+			__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
 	}
+	return NULL;
+}
 
-	diskimg = argv[1];
-	target_filename = argv[2];
+int main(int argc, char* argv[])
+{
+	char* listfile = NULL;		// Filename of the list of files to be sent
+	int num_threads = 1;		// Number of files copied at once
+	int stats = -1;				// Format of the statistics, -1 for none
+	struct option options[] = { {"stats", optional_argument, NULL, 's'}, {NULL, 0, NULL, 0} };
+	pthread_t* threads;
+	int opt;
+	int i;
+
+	while((opt = getopt_long(argc, argv, "j:f:", options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 'f':
+				listfile = optarg;
+				break;
+			case 's':
+				if((stats = parse_stats_option(optarg)) < 0)
+					num_threads = 0;
+				break;
+			default:
+				num_threads = 0;
+		}
+	}
 
-	// Open image file
-	if((fd = open(diskimg, O_RDONLY)) < 0)
+	if(num_threads < 1 || argc - optind < (listfile? 1 : 2))
 	{
-		perror("fopen()\n");
+		printf("Usage: $./diskget [-j threads] [--stats[=json]] <disk.img> <copyfilename>...\n"
+			   "       $./diskget [-j threads] [--stats[=json]] <disk.img> -f <listfile>\n"
+			   "       $./diskget [-j threads] [--stats[=json]] <disk.img> -    (filenames from stdin)\n");
 		exit(-1);
 	}
 
-	// Insert information on the disk image into the stats struct
-	if((fstat(fd, &fileStats)) == 1)
+	diskimg = argv[optind];
+
+	// gather the filenames from the command line, a list file or stdin
+	if(listfile != NULL || !strcmp(argv[optind+1], "-"))
 	{
-		perror("fstat()\n");
-		exit(-1);
+		if((names = read_name_list(listfile? listfile : "-", &num_names)) == NULL)
+			exit(-1);
 	}
-	//printf("%s file size: %d bytes\n",diskimg,fileStats.st_size);
-	
-	// Insert the bytes of the disk image into the map
-	if((map = mmap((caddr_t)0, 
-					fileStats.st_size,
-					 PROT_READ, 
-					 MAP_SHARED, 
-					 fd, 
-					 0)) == MAP_FAILED)
+	else
 	{
-		perror("mmap()\n");
-		exit(-1);
+		names = &argv[optind+1];
+		num_names = argc - optind - 1;
 	}
 
-	// Since the file is stored, close the file
-	close(fd);
+	// Open the image and read its metadata once for every file
+	if((img = disk_open(diskimg, DISK_READ_ONLY | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+		exit(-1);
+
+	// copy the files to the current directory, in parallel if asked to
+	if(num_threads > num_names)
+		num_threads = num_names;
+	if(num_threads <= 1)
+	{
+		getWorker(NULL);
+	}
+	else
+	{
+		threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+		for(i=0; i < num_threads; i++)
+			pthread_create(&threads[i], NULL, getWorker, NULL);
+		for(i=0; i < num_threads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
 
-	// copy the file to the current directory
-	printf("copying %s from %s...\n", target_filename, diskimg);
-	get_file(map, diskimg, target_filename);
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
+	disk_close(img);
 
-	return 0;
+	return failed? -1 : 0;
 }
 
-
 //////////////////////////////////////////
 
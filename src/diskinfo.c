@@ -23,59 +23,46 @@
 // Functions
 int main(int argc, char* argv[])
 {
-	char* diskimg;			// Filename of disk image
-	int fd;					// File descriptor of disk image
-	struct stat fileStats;	// Statistics of disk image
-	unsigned char* map;		// Map of the disk image as array of bytes
-
-	if(argc != 2)
-	{
-		printf("Usage: $./diskinfo <disk.img>");
-		exit(-1);
-	}
-
-	diskimg = argv[1];
-
-	// Open image file
-	if((fd = open(diskimg, O_RDONLY)) == -1)
+	char* diskimg;				// Filename of disk image
+	struct disk_image* img;		// The opened disk image
+	int stats = -1;				// Format of the statistics, -1 for none
+	int extents = 0;			// Print the fragmentation report
+	struct option options[] = { {"stats", optional_argument, NULL, 's'},
+		{"extents", no_argument, NULL, 'x'}, {NULL, 0, NULL, 0} };
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "x", options, NULL)) != -1)
 	{
-		perror("fopen()\n");
-		exit(-1);
+		if(opt == 'x')
+			extents = 1;
+		else if(opt != 's' || (stats = parse_stats_option(optarg)) < 0)
+			argc = 0;
 	}
 
-	// Insert information on the disk image into the stats struct
-	if((fstat(fd, &fileStats)) == 1)
-	{
-		perror("fstat()\n");
-		exit(-1);
-	}
-	//printf("%s file size: %d bytes\n",diskimg,fileStats.st_size);
-	
-	// Insert the bytes of the disk image into the map
-	if((map = mmap((caddr_t)0, 
-					fileStats.st_size,
-					 PROT_READ, 
-					 MAP_SHARED, 
-					 fd, 
-					 0)) == MAP_FAILED)
+	if(argc - optind != 1)
 	{
-		perror("mmap()\n");
+		printf("Usage: $./diskinfo [-x|--extents] [--stats[=json]] <disk.img>\n"
+			   "  -x  also report the fragmentation of the files and the free space\n");
 		exit(-1);
 	}
 
-	// Read the superblock and print it's information
-	read_superblock(map, 1);
+	diskimg = argv[optind];
 
-	// Traverse the FAT and record entry statistics
-	read_FAT(map, 1);
+	// Open the image and read its superblock and FAT
+	if((img = disk_open(diskimg, DISK_READ_ONLY | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+		exit(-1);
 
-	close(fd);
+	// Print the superblock and FAT information
+	disk_info(img);
+	if(extents)
+		disk_frag_info(img, 1);
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
 
 	// free the file system after usage
-	free_fileSystem();
+	disk_close(img);
 
 	return 0;
 }
 
-
 //////////////////////////////////////////
\ No newline at end of file
@@ -1,4 +1,5 @@
-/* Part2: Print the root directory and its containing file's information
+/* Part2: Print a directory, the root directory by default, and its
+*	containing file's information
 */
 
 //////////////////////////////////////////
@@ -23,63 +24,43 @@
 // Functions
 int main(int argc, char* argv[])
 {
-	char* diskimg;			// Filename of disk image
-	int fd;					// File descriptor of disk image
-	struct stat fileStats;	// Statistics of disk image
-	unsigned char* map;		// Map of the disk image as array of bytes
-
-	if(argc != 2)
+	char* diskimg;				// Filename of disk image
+	char* dirname = NULL;		// Directory to list, NULL for the root
+	int status;
+	struct disk_image* img;		// The opened disk image
+	int stats = -1;				// Format of the statistics, -1 for none
+	struct option options[] = { {"stats", optional_argument, NULL, 's'}, {NULL, 0, NULL, 0} };
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
 	{
-		printf("Usage: $./disklist <disk.img>");
-		exit(-1);
+		if(opt != 's' || (stats = parse_stats_option(optarg)) < 0)
+			argc = 0;
 	}
 
-	diskimg = argv[1];
-
-	// Open image file
-	if((fd = open(diskimg, O_RDONLY)) == -1)
+	if(argc - optind != 1 && argc - optind != 2)
 	{
-		perror("fopen()\n");
-		exit(-1);
-	}
-
-	// Insert information on the disk image into the stats struct
-	if((fstat(fd, &fileStats)) == 1)
-	{
-		perror("fstat()\n");
-		exit(-1);
-	}
-	//printf("%s file size: %d bytes\n",diskimg,fileStats.st_size);
-	
-	// Insert the bytes of the disk image into the map
-	if((map = mmap((caddr_t)0, 
-					fileStats.st_size,
-					 PROT_READ, 
-					 MAP_SHARED, 
-					 fd, 
-					 0)) == MAP_FAILED)
-	{
-		perror("mmap()\n");
+		printf("Usage: $./disklist [--stats[=json]] <disk.img> [directory]\n");
 		exit(-1);
 	}
 
+	diskimg = argv[optind];
+	if(argc - optind == 2)
+		dirname = argv[optind + 1];
 
-	// Read the superblock
-	read_superblock(map, 0);
-
-	// Traverse the FAT
-	read_FAT(map, 0);
+	// Open the image and read its metadata
+	if((img = disk_open(diskimg, DISK_READ_ONLY | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+		exit(-1);
 
-	// traverse the root (FDT) and print its information
-	read_FDT(map, 1);
+	// traverse the directory (FDT) and print its information
+	status = disk_list(img, dirname, stdout);
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
 
-	close(fd);
-	
 	// free the file system after usage
-	free_fileSystem();
+	disk_close(img);
 
-	return 0;
+	return status;
 }
 
-
 //////////////////////////////////////////
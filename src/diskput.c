@@ -7,26 +7,107 @@
 
 void showUsage(char *programName)
 {
-    printf("USAGE: %s imageFileName putFileName\n"
+    printf("USAGE: %s [-o] [--stats[=json]] [--mmap[=mode]] [--journal] imageFileName putFileName...\n"
+           "       %s [-o] [--stats[=json]] [--mmap[=mode]] [--journal] imageFileName -f listFileName\n"
+           "       %s [-o] [--stats[=json]] [--mmap[=mode]] [--journal] imageFileName -\n"
            "Where:\n"
            "\timageFileName : Disk image file\n"
-           "\tputFileName   : File we want to copy into disk\n",
-           programName);
+           "\tputFileName   : File we want to copy into disk\n"
+           "\tlistFileName  : File listing the files to copy, one per line\n"
+           "\t-             : Read the files to copy from stdin\n"
+           "\t-o            : Overwrite files already in the disk, reusing their blocks;\n"
+           "\t                a failed overwrite leaves them partly rewritten\n"
+           "\t--stats       : Print the time spent in each phase and counters,\n"
+           "\t                as a table or as JSON, on stderr\n"
+           "\t--mmap        : Store the files into a writable map of the image and\n"
+           "\t                msync it at the end (end, the default), after every\n"
+           "\t                file (file) or never (none)\n"
+           "\t--journal     : Commit the FAT and directory changes through\n"
+           "\t                imageFileName.journal, safe against crashes\n",
+           programName, programName, programName);
 }
 
 int main(int argc, char * argv[])
 {
+    struct disk_image* img;
+    struct option options[] = { {"stats", optional_argument, NULL, 's'},
+                                {"mmap", optional_argument, NULL, 'm'},
+                                {"journal", no_argument, NULL, 'J'}, {NULL, 0, NULL, 0} };
+    char* listFileName = NULL;
+    char** names;
+    int numNames;
+    int stats = -1;
+    int mmapFlags = 0;
+    int journal = 0;
+    int putFlags = 0;
+    int failed = 0;
+    int opt;
+    int i;
+
     /* Check input parameters */
-    if (argc != 3)
+    while ((opt = getopt_long(argc, argv, "f:o", options, NULL)) != -1)
+    {
+        if (opt == 'f')
+            listFileName = optarg;
+        else if (opt == 'o')
+            putFlags = DISK_OVERWRITE;
+        else if (opt == 'J')
+            journal = DISK_JOURNAL;
+        else if (opt == 'm')
+        {
+            if ((mmapFlags = parse_mmap_option(optarg)) < 0)
+                argc = 0;
+        }
+        else if (opt != 's' || (stats = parse_stats_option(optarg)) < 0)
+            argc = 0;
+    }
+
+    if (argc - optind < 2 - (listFileName != NULL) || (listFileName && argc - optind != 1))
     {
         printf("ERROR: Invalid parameters!!!\n");
         showUsage(argv[0]);
         exit(-1);
     }
 
-    put_file(argv[1], argv[2]);
+    /* Gather the files from the command line, a list file or stdin */
+    if (listFileName != NULL || !strcmp(argv[optind+1], "-"))
+    {
+        if ((names = read_name_list(listFileName? listFileName : "-", &numNames)) == NULL)
+        {
+            exit(-1);
+        }
+    }
+    else
+    {
+        names = &argv[optind+1];
+        numNames = argc - optind - 1;
+    }
 
-    return 0;
-}
+    if ((img = disk_open(argv[optind], DISK_WRITE | mmapFlags | journal | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+    {
+        exit(-1);
+    }
+
+    /* Allocate and write every file, the metadata is written once at the end */
+    for (i = 0; i < numNames; i++)
+    {
+        if (disk_put(img, names[i], putFlags) != 0)
+        {
+            failed++;
+        }
+    }
 
+    if (disk_sync(img) != 0)
+    {
+        failed++;
+    }
 
+    if (stats >= 0)
+    {
+        disk_print_stats(img, stderr, stats);
+    }
+
+    disk_close(img);
+
+    return failed? -1 : 0;
+}
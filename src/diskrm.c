@@ -0,0 +1,101 @@
+/* Part8: Remove files from the file system and free their blocks
+*/
+
+//////////////////////////////////////////
+// Headers
+#include "disk.h"
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Prototypes
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Globals
+
+//////////////////////////////////////////
+
+
+//////////////////////////////////////////
+// Functions
+int main(int argc, char* argv[])
+{
+	char* diskimg;				// Filename of disk image
+	struct disk_image* img;		// The opened disk image
+	char* listfile = NULL;		// Filename of the list of files to be removed
+	char** names;				// Filenames of the files to be removed
+	int num_names;
+	int journal = 0;			// Commit through the journal
+	int stats = -1;				// Format of the statistics, -1 for none
+	struct option options[] = { {"stats", optional_argument, NULL, 's'},
+								{"journal", no_argument, NULL, 'J'}, {NULL, 0, NULL, 0} };
+	int failed = 0;
+	int opt;
+	int i;
+
+	while((opt = getopt_long(argc, argv, "f:", options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'f':
+				listfile = optarg;
+				break;
+			case 'J':
+				journal = DISK_JOURNAL;
+				break;
+			case 's':
+				if((stats = parse_stats_option(optarg)) < 0)
+					argc = 0;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+
+	if(argc - optind < 2 - (listfile != NULL) || (listfile && argc - optind != 1))
+	{
+		printf("Usage: $./diskrm [--journal] [--stats[=json]] <disk.img> <filename>...\n"
+			   "       $./diskrm [--journal] [--stats[=json]] <disk.img> -f <listfile>\n"
+			   "       $./diskrm [--journal] [--stats[=json]] <disk.img> -    (filenames from stdin)\n");
+		exit(-1);
+	}
+
+	diskimg = argv[optind];
+
+	// gather the filenames from the command line, a list file or stdin
+	if(listfile != NULL || !strcmp(argv[optind+1], "-"))
+	{
+		if((names = read_name_list(listfile? listfile : "-", &num_names)) == NULL)
+			exit(-1);
+	}
+	else
+	{
+		names = &argv[optind+1];
+		num_names = argc - optind - 1;
+	}
+
+	if((img = disk_open(diskimg, DISK_WRITE | journal | ((stats >= 0)? DISK_STATS : 0))) == NULL)
+		exit(-1);
+
+	// the metadata of the whole batch is written once at the end
+	for(i=0; i < num_names; i++)
+	{
+		printf("removing %s from %s...\n", names[i], diskimg);
+		if(disk_remove(img, names[i]) != 0)
+			failed++;
+	}
+
+	if(disk_sync(img) != 0)
+		failed++;
+	if(stats >= 0)
+		disk_print_stats(img, stderr, stats);
+
+	disk_close(img);
+
+	return failed? -1 : 0;
+}
+
+//////////////////////////////////////////
@@ -0,0 +1,51 @@
+#!/bin/sh
+# diskput onto a name already in the image: refused without -o, replaced
+# in place with -o, and refused over a directory either way.
+# Run from src/ after make, e.g. make check
+
+bin=$(pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+fail=0
+
+check() {
+	if [ "$2" -ne 0 ]; then
+		echo "FAIL: $1"
+		fail=1
+	fi
+}
+
+"$bin/diskformat" -n 256 test.img > /dev/null || exit 1
+head -c 5000 /dev/urandom > foo.txt
+"$bin/diskput" test.img foo.txt > /dev/null || exit 1
+head -c 3000 /dev/urandom > foo.txt
+
+"$bin/diskput" test.img foo.txt > out.txt
+check "put without -o onto an existing file succeeded" $((! $?))
+grep -q "file exists, use -o" out.txt
+check "put without -o did not report the existing file" $?
+check "put without -o left foo.txt listed twice" \
+	$(($("$bin/disklist" test.img | grep -c ' foo.txt ') != 1))
+
+"$bin/diskput" -o test.img foo.txt > /dev/null
+check "put with -o failed" $?
+check "put with -o left foo.txt listed more than once" \
+	$(($("$bin/disklist" test.img | grep -c ' foo.txt ') != 1))
+mkdir got && (cd got && "$bin/diskget" ../test.img foo.txt > /dev/null)
+cmp -s foo.txt got/foo.txt
+check "diskget after put -o returned other data" $?
+
+# a file may not take the name of a directory
+mkdir -p sub/dir && echo data > sub/dir/file && "$bin/diskput" test.img sub/dir/file > /dev/null
+mv sub/dir sub/dir.d && echo data > sub/dir
+"$bin/diskput" -o test.img sub/dir > out.txt
+check "put -o over a directory succeeded" $((! $?))
+grep -q "it is a directory" out.txt
+check "put over a directory did not report it" $?
+
+"$bin/diskcheck" test.img > /dev/null
+check "diskcheck found problems" $?
+
+[ $fail -eq 0 ] && echo "put_existing: ok"
+exit $fail